@@ -5,6 +5,8 @@
 //  Created by Maksim Chichkan on 4/29/22.
 //
 
+#pragma once
+
 #ifndef Components_h
 #define Components_h
 
@@ -12,6 +14,264 @@
 #endif /* Components_h */
 
 
+//==============================================================================
+/** Waveshaper curves, each with the antiderivative that AdaaWaveShaper needs.
+    Every curve passes through the origin and its antiderivative is 0 there.
+*/
+namespace WaveshaperCurves
+{
+    struct Tanh
+    {
+        template <typename T>
+        static T function (T x) noexcept       { return std::tanh (x); }
+
+        /** log (cosh (x)), written so that it can't overflow. */
+        template <typename T>
+        static T antiderivative (T x) noexcept
+        {
+            auto a = std::abs (x);
+            return a + std::log1p (std::exp (T (-2) * a)) - T (0.693147180559945309);
+        }
+    };
+
+    /** Scaled to saturate at +-1 like the others. */
+    struct Arctan
+    {
+        template <typename T>
+        static T function (T x) noexcept       { return T (2) / juce::MathConstants<T>::pi * std::atan (x); }
+
+        template <typename T>
+        static T antiderivative (T x) noexcept
+        {
+            return T (2) / juce::MathConstants<T>::pi * (x * std::atan (x) - T (0.5) * std::log1p (x * x));
+        }
+    };
+
+    struct HardClip
+    {
+        template <typename T>
+        static T function (T x) noexcept       { return juce::jlimit (T (-1), T (1), x); }
+
+        template <typename T>
+        static T antiderivative (T x) noexcept
+        {
+            auto a = std::abs (x);
+            return a <= T (1) ? T (0.5) * x * x : a - T (0.5);
+        }
+    };
+
+    /** Exponential saturation that clips the negative half twice as early, for even harmonics. */
+    struct Tube
+    {
+        static constexpr double negativeLimit = 0.5;
+
+        template <typename T>
+        static T function (T x) noexcept
+        {
+            constexpr auto a = T (negativeLimit);
+            return x >= T (0) ? T (1) - std::exp (-x) : a * (std::exp (x / a) - T (1));
+        }
+
+        template <typename T>
+        static T antiderivative (T x) noexcept
+        {
+            constexpr auto a = T (negativeLimit);
+            return x >= T (0) ? x + std::exp (-x) - T (1) : a * a * (std::exp (x / a) - T (1)) - a * x;
+        }
+    };
+
+    /** A sine folder: loud input folds back over itself instead of flattening out. */
+    struct Foldback
+    {
+        template <typename T>
+        static T function (T x) noexcept       { return std::sin (x); }
+
+        template <typename T>
+        static T antiderivative (T x) noexcept { return T (1) - std::cos (x); }
+    };
+
+    /** The exponential knee of a pair of anti-parallel diodes. */
+    struct Diode
+    {
+        template <typename T>
+        static T function (T x) noexcept
+        {
+            return std::copysign (T (1) - std::exp (-std::abs (x)), x);
+        }
+
+        template <typename T>
+        static T antiderivative (T x) noexcept
+        {
+            auto a = std::abs (x);
+            return a + std::exp (-a) - T (1);
+        }
+    };
+}
+
+//==============================================================================
+/** A waveshaper with first order antiderivative anti-aliasing: each output is the
+    mean of the curve between the previous input and this one, which is the
+    difference of the antiderivative over the difference of the inputs. That takes
+    out most of the aliasing oversampling would, for one extra subtraction and
+    division per sample and half a sample of delay.
+
+    The curves are template parameters, so the inner loop has no dispatch in it;
+    process() picks the instantiation once per block. One channel per instance.
+*/
+template <typename Type>
+class AdaaWaveShaper
+{
+public:
+    //==============================================================================
+    enum Curve
+    {
+        tanh,
+        arctan,
+        hardClip,
+        tube,
+        foldback,
+        diode
+    };
+
+    //==============================================================================
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        jassert (spec.numChannels == 1);
+        juce::ignoreUnused (spec);
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        previousInput = Type (0);
+        previousAntiderivative = 0.0;
+    }
+
+    //==============================================================================
+    void setCurve (Curve newValue) noexcept
+    {
+        if (curve == newValue)
+            return;
+
+        curve = newValue;
+
+        // the stored antiderivative belongs to the old curve
+        dispatch ([this] (auto curveType)
+                  {
+                      previousAntiderivative = decltype (curveType)::antiderivative ((double) previousInput);
+                  });
+    }
+
+    Curve getCurve() const noexcept
+    {
+        return curve;
+    }
+
+    /** Calls function with the WaveshaperCurves type for curve, for callers that pick an
+        instantiation once and then shape through processSample<CurveType>().
+    */
+    template <typename Function>
+    static void dispatch (Curve curve, Function&& function)
+    {
+        switch (curve)
+        {
+            case tanh:      function (WaveshaperCurves::Tanh {});     break;
+            case arctan:    function (WaveshaperCurves::Arctan {});   break;
+            case hardClip:  function (WaveshaperCurves::HardClip {}); break;
+            case tube:      function (WaveshaperCurves::Tube {});     break;
+            case foldback:  function (WaveshaperCurves::Foldback {}); break;
+            case diode:     function (WaveshaperCurves::Diode {});    break;
+            default:        jassertfalse;                              break;
+        }
+    }
+
+    //==============================================================================
+    template <typename ProcessContext>
+    void process (const ProcessContext& context) noexcept
+    {
+        dispatch ([this, &context] (auto curveType)
+                  {
+                      process<decltype (curveType)> (context);
+                  });
+    }
+
+    template <typename CurveType, typename ProcessContext>
+    void process (const ProcessContext& context) noexcept
+    {
+        auto& inputBlock  = context.getInputBlock();
+        auto& outputBlock = context.getOutputBlock();
+
+        jassert (inputBlock.getNumChannels() == 1 && outputBlock.getNumChannels() == 1);
+
+        if (context.isBypassed)
+        {
+            if (context.usesSeparateInputAndOutputBlocks())
+                outputBlock.copyFrom (inputBlock);
+
+            return;
+        }
+
+        auto* input  = inputBlock .getChannelPointer (0);
+        auto* output = outputBlock.getChannelPointer (0);
+
+        for (size_t i = 0; i < outputBlock.getNumSamples(); ++i)
+            output[i] = processSample<CurveType> (input[i]);
+    }
+
+    //==============================================================================
+    /** For callers that shape one sample at a time, like the delay's feedback path. */
+    Type processSample (Type x) noexcept
+    {
+        Type y {};
+        dispatch ([this, x, &y] (auto curveType) { y = processSample<decltype (curveType)> (x); });
+        return y;
+    }
+
+    template <typename CurveType>
+    Type processSample (Type x) noexcept
+    {
+        // The antiderivative grows like |x|, so at high drive its difference cancels away
+        // most of a float's digits; it's taken in double, and the tolerance is relative to
+        // the inputs' size. Below it the curve at the midpoint is as good.
+        constexpr auto relativeTolerance = 1.0e-6;
+
+        auto antiderivative = CurveType::antiderivative ((double) x);
+        auto difference = (double) x - (double) previousInput;
+        auto tolerance = relativeTolerance * juce::jmax (1.0, std::abs ((double) x), std::abs ((double) previousInput));
+
+        auto y = std::abs (difference) > tolerance
+                   ? (Type) ((antiderivative - previousAntiderivative) / difference)
+                   : CurveType::function (Type (0.5) * (x + previousInput));
+
+        previousInput = x;
+        previousAntiderivative = antiderivative;
+
+        return y;
+    }
+
+private:
+    //==============================================================================
+    template <typename Function>
+    void dispatch (Function&& function)
+    {
+        dispatch (curve, std::forward<Function> (function));
+    }
+
+    Curve curve { tanh };
+    Type previousInput { 0 };
+    double previousAntiderivative { 0 };
+};
+
+//==============================================================================
+/** Pre gain, waveshaper and post gain, with optional automatic compensation of the
+    level change the pre gain and curve bring.
+
+    Tracking compensation follows the ratio of the input's and the shaped signal's
+    mean squares, each smoothed across blocks, and ramps a gain after the waveshaper
+    towards it. Static compensation reads a fixed estimate for the curve and pre gain
+    from a table built once, and folds it into the post gain, so it costs nothing
+    while processing and always gives the same result.
+*/
 template <typename Type>
 class Distortion
 {
@@ -23,40 +283,69 @@ private:
         waveshaperIndex,
         postGainIndex,
     };
-    using WaveShaper = juce::dsp::WaveShaper<Type>;
-    using Gain = juce::dsp::Gain<float>;
+    using WaveShaper = AdaaWaveShaper<Type>;
+    using Gain = juce::dsp::Gain<Type>;
     using ProcessorChain = juce::dsp::ProcessorChain<Gain, WaveShaper, Gain>;
 
     std::unique_ptr<ProcessorChain> processorChain;
     
 public:
     //==============================================================================
+    using Curve = typename WaveShaper::Curve;
+    
+    enum AutoGain
+    {
+        autoGainOff,
+        autoGainTracking,
+        autoGainStatic
+    };
+    
     Type preGainAmount { Type (0) };
     Type postGainAmount { Type (0) };
     
     Distortion()
     {
         processorChain = std::make_unique<ProcessorChain>();
-        
-        auto& waveshaper = processorChain->template get<waveshaperIndex>();
-        
-        waveshaper.functionToUse = [] (Type x)
-                                   {
-                                       return std::tanh (x);
-                                   };
     }
 
     //==============================================================================
     void prepare (const juce::dsp::ProcessSpec& spec)
     {
         processorChain.get()->prepare (spec);
+        
+        sampleRate = spec.sampleRate;
+        compensationGain.prepare (spec);
+        compensationGain.setRampDurationSeconds (0.05);
+        
+        // builds the tables here rather than on the audio thread
+        getCompensationTables();
+        
+        resetCompensation();
     }
 
     //==============================================================================
     template <typename ProcessContext>
     void process (const ProcessContext& context) noexcept
     {
-        processorChain.get()->process (context);
+        if (autoGain != autoGainTracking || context.isBypassed)
+        {
+            processorChain.get()->process (context);
+            return;
+        }
+        
+        // the stages run one by one, so the level can be measured either side of the waveshaper
+        auto& outputBlock = context.getOutputBlock();
+        auto inputMeanSquare = getMeanSquare (context.getInputBlock());
+        
+        processorChain->template get<preGainIndex>().process (context);
+        
+        juce::dsp::ProcessContextReplacing<Type> replacingContext (outputBlock);
+        processorChain->template get<waveshaperIndex>().process (replacingContext);
+        
+        updateTrackingCompensation (inputMeanSquare, getMeanSquare (outputBlock), outputBlock.getNumSamples());
+        
+        compensationGain.process (replacingContext);
+        processorChain->template get<postGainIndex>().process (replacingContext);
     }
     
     //==============================================================================
@@ -74,10 +363,41 @@ public:
         return processedSample;
     }
 
+    //==============================================================================
+    /** Stands in for process() on a block that's known to be silent, which stays silent:
+        the waveshaper forgets its last input, as it would have, and the compensation
+        gain moves on along its ramp. The tracked levels are kept, as they would be.
+    */
+    void skipSilence (const juce::dsp::ProcessContextReplacing<Type>& context) noexcept
+    {
+        processorChain->template get<waveshaperIndex>().reset();
+
+        if (compensationGain.isSmoothing())
+            compensationGain.process (context);
+    }
+
     //==============================================================================
     void reset() noexcept
     {
-        processorChain.reset();
+        processorChain->reset();
+        resetCompensation();
+    }
+    
+    //==============================================================================
+    void setCurve (Curve newValue) noexcept
+    {
+        processorChain->template get<waveshaperIndex>().setCurve (newValue);
+        updatePostGain();
+    }
+    
+    void setAutoGain (AutoGain newValue) noexcept
+    {
+        if (autoGain == newValue)
+            return;
+        
+        autoGain = newValue;
+        resetCompensation();
+        updatePostGain();
     }
     
     //==============================================================================
@@ -86,14 +406,15 @@ public:
     {
         auto& preGain = processorChain->template get<preGainIndex>();
         preGain.setGainDecibels(amount);
+        updatePostGain();
     }
     
     //==============================================================================
     template <typename AmountType>
     void setPostGain (const AmountType& amount) noexcept
     {
-        auto& postGain = processorChain->template get<postGainIndex>();
-        postGain.setGainDecibels(amount);
+        postGainInDecibels = (Type) amount;
+        updatePostGain();
     }
     
     //==============================================================================
@@ -102,131 +423,1992 @@ public:
         return processorChain->template get<preGainIndex>().getGainDecibels();
     }
     
+    /** The post gain as set, without any compensation. */
     auto getPostGain () noexcept
     {
-        return processorChain->template get<postGainIndex>().getGainDecibels();
+        return postGainInDecibels;
     }
     
-
-
-};
-
-//==============================================================================
-template <typename Type>
-class DelayLine
-{
-public:
-    void clear() noexcept
-    {
-        std::fill (rawData.begin(), rawData.end(), Type (0));
-    }
-
-    size_t size() const noexcept
+    //==============================================================================
+    /** The gain, in decibels, that brings a sine at the reference level back to its own
+        level after preGainInDecibels and the curve.
+    */
+    static Type getStaticCompensation (Curve curve, Type preGainInDecibels) noexcept
     {
-        return rawData.size();
+        const auto& table = getCompensationTables()[(size_t) curve];
+        
+        auto position = juce::jlimit (Type (0), Type (numCompensationPoints - 1), preGainInDecibels - Type (minCompensationDrive));
+        auto index = juce::jmin ((int) position, numCompensationPoints - 2);
+        auto fraction = position - (Type) index;
+        
+        return table[(size_t) index] + fraction * (table[(size_t) index + 1] - table[(size_t) index]);
     }
 
-    void resize (size_t newValue)
+private:
+    //==============================================================================
+    // one table point per decibel of pre gain, covering the band drive offsets too
+    static constexpr int minCompensationDrive = -24;
+    static constexpr int numCompensationPoints = 97;
+    static constexpr double compensationReferenceLevel = 0.25;
+    static constexpr double maxCompensation = 24.0;
+    
+    using CompensationTable = std::array<Type, (size_t) numCompensationPoints>;
+    
+    static const std::array<CompensationTable, 6>& getCompensationTables()
     {
-        rawData.resize (newValue);
-        leastRecentIndex = 0;
+        static const auto tables = []
+        {
+            std::array<CompensationTable, 6> newTables {};
+            
+            auto fill = [] (CompensationTable& table, auto curveType)
+            {
+                constexpr int numSamples = 64;
+                
+                for (int point = 0; point < numCompensationPoints; ++point)
+                {
+                    auto drive = juce::Decibels::decibelsToGain ((double) (minCompensationDrive + point));
+                    auto inputSum = 0.0, outputSum = 0.0;
+                    
+                    for (int i = 0; i < numSamples; ++i)
+                    {
+                        auto x = compensationReferenceLevel * std::sin (juce::MathConstants<double>::twoPi * (i + 0.5) / numSamples);
+                        auto y = decltype (curveType)::function (drive * x);
+                        
+                        inputSum += x * x;
+                        outputSum += y * y;
+                    }
+                    
+                    auto compensation = outputSum > 0.0 ? 10.0 * std::log10 (inputSum / outputSum) : maxCompensation;
+                    table[(size_t) point] = (Type) juce::jlimit (-maxCompensation, maxCompensation, compensation);
+                }
+            };
+            
+            fill (newTables[WaveShaper::tanh],     WaveshaperCurves::Tanh {});
+            fill (newTables[WaveShaper::arctan],   WaveshaperCurves::Arctan {});
+            fill (newTables[WaveShaper::hardClip], WaveshaperCurves::HardClip {});
+            fill (newTables[WaveShaper::tube],     WaveshaperCurves::Tube {});
+            fill (newTables[WaveShaper::foldback], WaveshaperCurves::Foldback {});
+            fill (newTables[WaveShaper::diode],    WaveshaperCurves::Diode {});
+            
+            return newTables;
+        }();
+        
+        return tables;
     }
-
-    Type back() const noexcept
+    
+    void updatePostGain() noexcept
     {
-        return rawData[leastRecentIndex];
+        auto compensation = autoGain == autoGainStatic
+                          ? getStaticCompensation (processorChain->template get<waveshaperIndex>().getCurve(), getPreGain())
+                          : Type (0);
+        
+        processorChain->template get<postGainIndex>().setGainDecibels (postGainInDecibels + compensation);
     }
-
-    Type get (size_t delayInSamples) const noexcept
+    
+    //==============================================================================
+    static Type getMeanSquare (const juce::dsp::AudioBlock<const Type>& block) noexcept
     {
-        jassert (delayInSamples >= 0 && delayInSamples < size());
- 
-        return rawData[(leastRecentIndex + 1 + delayInSamples) % size()];   // [3]
+        auto sum = Type (0);
+        
+        for (size_t ch = 0; ch < block.getNumChannels(); ++ch)
+        {
+            auto* data = block.getChannelPointer (ch);
+            
+            for (size_t i = 0; i < block.getNumSamples(); ++i)
+                sum += data[i] * data[i];
+        }
+        
+        auto numValues = block.getNumChannels() * block.getNumSamples();
+        return numValues > 0 ? sum / (Type) numValues : Type (0);
     }
-
-    /** Set the specified sample in the delay line */
-    void set (size_t delayInSamples, Type newValue) noexcept
+    
+    void updateTrackingCompensation (Type inputMeanSquare, Type outputMeanSquare, size_t numSamples) noexcept
     {
-        jassert (delayInSamples >= 0 && delayInSamples < size());
- 
-        rawData[(leastRecentIndex + 1 + delayInSamples) % size()] = newValue; // [4]
+        // below -60 dB there's too little to go by, so the last estimate is kept
+        if (inputMeanSquare < Type (1.0e-6))
+            return;
+        
+        auto coefficient = (Type) (1.0 - std::exp (-(double) numSamples / (trackingTime * sampleRate)));
+        
+        inputLevel += coefficient * (inputMeanSquare - inputLevel);
+        outputLevel += coefficient * (outputMeanSquare - outputLevel);
+        
+        auto ratio = outputLevel > Type (0) ? std::sqrt (inputLevel / outputLevel) : Type (1);
+        auto limit = (Type) juce::Decibels::decibelsToGain (maxCompensation);
+        
+        compensationGain.setGainLinear (juce::jlimit (Type (1) / limit, limit, ratio));
     }
-
-    /** Adds a new value to the delay line, overwriting the least recently added sample */
-    void push (Type valueToAdd) noexcept
+    
+    void resetCompensation() noexcept
     {
-        rawData[leastRecentIndex] = valueToAdd;                                         // [1]
-        leastRecentIndex = leastRecentIndex == 0 ? size() - 1 : leastRecentIndex - 1;   // [2]
+        inputLevel = outputLevel = Type (0);
+        compensationGain.setGainLinear (Type (1));
+        compensationGain.reset();
     }
-
-private:
-    std::vector<Type> rawData;
-    size_t leastRecentIndex = 0;
+    
+    // long enough to ride over single notes rather than follow their envelopes
+    static constexpr double trackingTime = 0.3;
+    
+    AutoGain autoGain { autoGainOff };
+    Type postGainInDecibels { Type (0) };
+    
+    Gain compensationGain;
+    Type inputLevel { Type (0) }, outputLevel { Type (0) };
+    double sampleRate { 44.1e3 };
 };
 
 //==============================================================================
-template <typename Type, size_t maxNumChannels = 1>
-class Delay
+/** Distortion split into up to four bands by Linkwitz-Riley crossovers, each band
+    with its own drive, output gain and waveshaper, so the low end can be kept clean.
+
+    The crossovers form a tree (each one splits the highs left by the previous one)
+    and the lower bands go through matching allpasses, so the bands sum back flat.
+    Every band is shaped by the same anti-aliased curve as the single band
+    distortion, through its own AdaaWaveShaper, and the curve is picked once per
+    block. Each band's shaper delays it by the same half sample, so the sum stays
+    flat. One channel per instance.
+*/
+template <typename Type>
+class MultibandDistortion
 {
 public:
     //==============================================================================
-    Delay()
+    static constexpr size_t maxNumBands = 4;
+
+    using Lanes = std::array<Type, maxNumBands>;
+    using WaveShaper = AdaaWaveShaper<Type>;
+    using Curve = typename WaveShaper::Curve;
+
+    //==============================================================================
+    MultibandDistortion()
     {
-        setMaxDelayTime (3.1f);
+        for (auto& allpass : allpasses)
+            allpass.setType (juce::dsp::LinkwitzRileyFilterType::allpass);
+
+        crossoverFrequencies = { Type (200), Type (1000), Type (4000) };
+        preGains.fill (Type (1));
+        postGains.fill (Type (1));
+        targetPreGains = preGains;
+        targetPostGains = postGains;
     }
 
     //==============================================================================
     void prepare (const juce::dsp::ProcessSpec& spec)
     {
-        jassert (spec.numChannels <= maxNumChannels);
-        sampleRate = (Type) spec.sampleRate;
-        updateDelayLineSize();
-        updateDelayTime();
+        jassert (spec.numChannels == 1);
 
-        lowCutCoefficients = juce::dsp::IIR::Coefficients<Type>::makeFirstOrderHighPass (sampleRate, lowCutFreq);
-        highCutCoefficients = juce::dsp::IIR::Coefficients<Type>::makeFirstOrderLowPass (sampleRate, highCutFreq);
+        for (auto& crossover : crossovers)
+            crossover.prepare (spec);
 
-        for (auto& f : lowCutFilters)
-        {
-            f.prepare (spec);
-            f.coefficients = lowCutCoefficients;
-        }
-        
-        for (auto& f : lowCutFilters)
-        {
-            f.prepare (spec);
-            f.coefficients = highCutCoefficients;
-        }
+        for (auto& allpass : allpasses)
+            allpass.prepare (spec);
+
+        updateCrossovers();
+        reset();
     }
 
-    //==============================================================================
     void reset() noexcept
     {
-        for (auto& f : lowCutFilters)
-            f.reset();      // [5]
-        for (auto& f : highCutFilters)
-            f.reset();      // [5]
- 
-        for (auto& dline : delayLines)
-            dline.clear();  // [6]
+        for (auto& crossover : crossovers)
+            crossover.reset();
+
+        for (auto& allpass : allpasses)
+            allpass.reset();
+
+        for (auto& shaper : shapers)
+            shaper.reset();
+
+        preGains = targetPreGains;
+        postGains = targetPostGains;
     }
 
     //==============================================================================
-    size_t getNumChannels() const noexcept
+    void setNumBands (size_t newValue) noexcept
     {
-        return delayLines.size();
+        jassert (newValue >= 1 && newValue <= maxNumBands);
+        numBands = juce::jlimit ((size_t) 1, maxNumBands, newValue);
     }
 
-    //==============================================================================
-    void setMaxDelayTime (Type newValue)
+    size_t getNumBands() const noexcept
     {
-        jassert (newValue > Type (0));
-        maxDelayTime = newValue;
-        updateDelayLineSize(); // [1]
+        return numBands;
     }
-    
-    //==============================================================================
-    void setLowCutFreq (Type newValue) noexcept
+
+    void setCurve (Curve newValue) noexcept
+    {
+        for (auto& shaper : shapers)
+            shaper.setCurve (newValue);
+    }
+
+    Curve getCurve() const noexcept
+    {
+        return shapers[0].getCurve();
+    }
+
+    /** Sets the frequency between band index and band index + 1. */
+    void setCrossoverFrequency (size_t index, Type newValue) noexcept
+    {
+        jassert (index < crossovers.size());
+
+        if (crossoverFrequencies[index] == newValue)
+            return;
+
+        crossoverFrequencies[index] = newValue;
+        updateCrossovers();
+    }
+
+    /** Sets a band's drive and output gain in decibels. They're ramped to across the next block. */
+    void setBandGains (size_t band, Type preGainInDecibels, Type postGainInDecibels) noexcept
+    {
+        jassert (band < maxNumBands);
+        targetPreGains[band]  = juce::Decibels::decibelsToGain (preGainInDecibels);
+        targetPostGains[band] = juce::Decibels::decibelsToGain (postGainInDecibels);
+    }
+
+    //==============================================================================
+    template <typename ProcessContext>
+    void process (const ProcessContext& context) noexcept
+    {
+        WaveShaper::dispatch (getCurve(), [this, &context] (auto curveType)
+                              {
+                                  process<decltype (curveType)> (context);
+                              });
+    }
+
+    template <typename CurveType, typename ProcessContext>
+    void process (const ProcessContext& context) noexcept
+    {
+        auto& inputBlock  = context.getInputBlock();
+        auto& outputBlock = context.getOutputBlock();
+        auto numSamples = outputBlock.getNumSamples();
+
+        jassert (inputBlock.getNumChannels() == 1 && outputBlock.getNumChannels() == 1);
+
+        auto* input  = inputBlock .getChannelPointer (0);
+        auto* output = outputBlock.getChannelPointer (0);
+
+        Lanes preGainIncrements {}, postGainIncrements {};
+
+        for (size_t k = 0; k < maxNumBands; ++k)
+        {
+            preGainIncrements[k]  = (targetPreGains[k]  - preGains[k])  / (Type) juce::jmax (numSamples, (size_t) 1);
+            postGainIncrements[k] = (targetPostGains[k] - postGains[k]) / (Type) juce::jmax (numSamples, (size_t) 1);
+        }
+
+        for (size_t i = 0; i < numSamples; ++i)
+        {
+            auto bands = split (input[i]);
+            auto sum = Type (0);
+
+            for (size_t k = 0; k < maxNumBands; ++k)
+            {
+                preGains[k]  += preGainIncrements[k];
+                postGains[k] += postGainIncrements[k];
+            }
+
+            for (size_t k = 0; k < numBands; ++k)
+                sum += shapers[k].template processSample<CurveType> (bands[k] * preGains[k]) * postGains[k];
+
+            output[i] = sum;
+        }
+
+        preGains = targetPreGains;
+        postGains = targetPostGains;
+    }
+
+private:
+    //==============================================================================
+    /** Splits a sample into the bands, lowest first; lanes above numBands are left at 0. */
+    Lanes split (Type x) noexcept
+    {
+        Lanes bands {};
+        auto rest = x;
+
+        for (size_t k = 0; k + 1 < numBands; ++k)
+        {
+            Type low, high;
+            crossovers[k].processSample (0, rest, low, high);
+
+            // keep the bands below in phase with this crossover's split
+            for (size_t j = 0; j < k; ++j)
+                bands[j] = allpasses[allpassIndex (j, k)].processSample (0, bands[j]);
+
+            bands[k] = low;
+            rest = high;
+        }
+
+        bands[numBands - 1] = rest;
+        return bands;
+    }
+
+    /** The allpass that band j (below crossover k) goes through to match crossover k. */
+    static constexpr size_t allpassIndex (size_t j, size_t k) noexcept
+    {
+        return k * (k - 1) / 2 + j;
+    }
+
+    void updateCrossovers() noexcept
+    {
+        for (size_t k = 0; k < crossovers.size(); ++k)
+        {
+            crossovers[k].setCutoffFrequency (crossoverFrequencies[k]);
+
+            for (size_t j = 0; j < k; ++j)
+                allpasses[allpassIndex (j, k)].setCutoffFrequency (crossoverFrequencies[k]);
+        }
+    }
+
+    size_t numBands { 1 };
+
+    std::array<juce::dsp::LinkwitzRileyFilter<Type>, maxNumBands - 1> crossovers;
+    std::array<juce::dsp::LinkwitzRileyFilter<Type>, 3> allpasses;     // one per (band, higher crossover) pair
+    std::array<Type, maxNumBands - 1> crossoverFrequencies {};
+    std::array<WaveShaper, maxNumBands> shapers;
+
+    Lanes preGains {}, postGains {}, targetPreGains {}, targetPostGains {};
+};
+
+//==============================================================================
+/** b0, b1, b2, a1, a2, normalised by a0 as in juce::dsp::IIR::Coefficients */
+using BiquadCoefficients = std::array<double, 5>;
+
+/** A cut filter design as plain values, so it can be handed between threads
+    without allocating or freeing anything on the way.
+*/
+struct CutFilterDesign
+{
+    std::array<BiquadCoefficients, 4> stages {};
+    size_t numStages { 0 };
+    bool bypassed { false };
+
+    bool operator== (const CutFilterDesign& other) const noexcept
+    {
+        return stages == other.stages && numStages == other.numStages && bypassed == other.bypassed;
+    }
+
+    bool operator!= (const CutFilterDesign& other) const noexcept
+    {
+        return ! operator== (other);
+    }
+};
+
+//==============================================================================
+/** Butterworth high- or low-pass made from a cascade of TPT state variable filters,
+    one channel per instance.
+
+    Unlike a biquad, an SVF stays stable and well behaved while its cutoff moves, so
+    process() ramps the prewarped cutoff g linearly across each block instead of
+    stepping to it, and fast sweeps don't zipper. Only one tan() is needed per block,
+    or one per controlInterval samples when the cutoff is modulated.
+*/
+template <typename Type>
+class SvfCutFilter
+{
+public:
+    //==============================================================================
+    enum Mode
+    {
+        highPass,
+        lowPass
+    };
+
+    static constexpr size_t maxNumSections = 4;
+
+    /** Samples between exact evaluations of a modulated cutoff; g is ramped in between. */
+    static constexpr size_t controlInterval = 16;
+
+    //==============================================================================
+    SvfCutFilter()
+    {
+        setNumSections (1);
+    }
+
+    //==============================================================================
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        jassert (spec.numChannels == 1);
+        sampleRate = (Type) spec.sampleRate;
+        targetG = prewarp (cutoffFrequency);
+        reset();
+    }
+
+    /** Clears the filter state and jumps straight to the latest cutoff. */
+    void reset() noexcept
+    {
+        for (auto& s : states)
+            s.fill (Type (0));
+
+        g = targetG;
+        previousCutoffFrequency = cutoffFrequency;
+    }
+
+    //==============================================================================
+    void setMode (Mode newValue) noexcept
+    {
+        mode = newValue;
+    }
+
+    /** Number of second-order sections, 1 to 4 for 12 to 48 dB/oct. */
+    void setNumSections (size_t newValue) noexcept
+    {
+        jassert (newValue >= 1 && newValue <= maxNumSections);
+        newValue = juce::jlimit ((size_t) 1, maxNumSections, newValue);
+
+        if (newValue == numSections)
+            return;
+
+        // section k of an order N Butterworth has damping R = 1 / 2Q = cos ((2k + 1) pi / 2N)
+        auto order = Type (2 * newValue);
+
+        for (size_t k = 0; k < newValue; ++k)
+            damping[k] = std::cos (juce::MathConstants<Type>::pi * Type (2 * k + 1) / (Type (2) * order));
+
+        // sections that join the cascade start from silence
+        for (auto k = numSections; k < newValue; ++k)
+            states[k].fill (Type (0));
+
+        numSections = newValue;
+    }
+
+    /** Sets the cutoff the next process() call ramps to. */
+    void setCutoffFrequency (Type newValue) noexcept
+    {
+        jassert (newValue > Type (0));
+        cutoffFrequency = newValue;
+        targetG = prewarp (newValue);
+    }
+
+    //==============================================================================
+    template <typename ProcessContext>
+    void process (const ProcessContext& context) noexcept
+    {
+        auto& inputBlock  = context.getInputBlock();
+        auto& outputBlock = context.getOutputBlock();
+        auto numSamples = outputBlock.getNumSamples();
+
+        jassert (inputBlock.getNumChannels() == 1 && outputBlock.getNumChannels() == 1);
+
+        auto* input  = inputBlock .getChannelPointer (0);
+        auto* output = outputBlock.getChannelPointer (0);
+
+        auto gIncrement = (targetG - g) / (Type) juce::jmax (numSamples, (size_t) 1);
+
+        for (size_t i = 0; i < numSamples; ++i)
+        {
+            g += gIncrement;
+            output[i] = processSample (input[i]);
+        }
+
+        g = targetG;
+        previousCutoffFrequency = cutoffFrequency;
+    }
+
+    /** Like process(), but with the cutoff moved by cutoffOctaves[i] octaves at each sample.
+        The exact cutoff is worked out every controlInterval samples and g ramped in between.
+    */
+    template <typename ProcessContext, typename ModulationType>
+    void process (const ProcessContext& context, const ModulationType* cutoffOctaves) noexcept
+    {
+        if (cutoffOctaves == nullptr)
+        {
+            process (context);
+            return;
+        }
+
+        auto& inputBlock  = context.getInputBlock();
+        auto& outputBlock = context.getOutputBlock();
+        auto numSamples = outputBlock.getNumSamples();
+
+        jassert (inputBlock.getNumChannels() == 1 && outputBlock.getNumChannels() == 1);
+
+        auto* input  = inputBlock .getChannelPointer (0);
+        auto* output = outputBlock.getChannelPointer (0);
+
+        for (size_t start = 0; start < numSamples; start += controlInterval)
+        {
+            auto end = juce::jmin (start + controlInterval, numSamples);
+
+            // the unmodulated cutoff still ramps from the last block's value to the new one
+            auto position = (Type) end / (Type) numSamples;
+            auto cutoff = previousCutoffFrequency + position * (cutoffFrequency - previousCutoffFrequency);
+            auto nextG = prewarp (cutoff * std::exp2 ((Type) cutoffOctaves[end - 1]));
+            auto gIncrement = (nextG - g) / (Type) (end - start);
+
+            for (auto i = start; i < end; ++i)
+            {
+                g += gIncrement;
+                output[i] = processSample (input[i]);
+            }
+
+            g = nextG;
+        }
+
+        previousCutoffFrequency = cutoffFrequency;
+    }
+
+    /** Filters one sample at the current cutoff, without moving it towards the target. */
+    Type processSample (Type x) noexcept
+    {
+        for (size_t k = 0; k < numSections; ++k)
+        {
+            auto& s = states[k];
+            auto twoRPlusG = Type (2) * damping[k] + g;
+
+            auto highPassed = (x - twoRPlusG * s[0] - s[1]) / (Type (1) + g * twoRPlusG);
+
+            auto v1 = g * highPassed;
+            auto bandPassed = v1 + s[0];
+            s[0] = bandPassed + v1;
+
+            auto v2 = g * bandPassed;
+            auto lowPassed = v2 + s[1];
+            s[1] = lowPassed + v2;
+
+            x = mode == highPass ? highPassed : lowPassed;
+        }
+
+        return x;
+    }
+
+private:
+    //==============================================================================
+    Type prewarp (Type frequency) const noexcept
+    {
+        auto limited = juce::jlimit (Type (1), Type (0.49) * sampleRate, frequency);
+        return std::tan (juce::MathConstants<Type>::pi * limited / sampleRate);
+    }
+
+    Mode mode { highPass };
+    size_t numSections { 0 };
+    std::array<Type, maxNumSections> damping {};
+    std::array<std::array<Type, 2>, maxNumSections> states {};
+
+    Type sampleRate { Type (44.1e3) };
+    Type cutoffFrequency { Type (1000) }, previousCutoffFrequency { Type (1000) };
+    Type g { Type (0) }, targetG { Type (0) };
+};
+
+//==============================================================================
+/** Follows the level of a multichannel signal: one envelope for all the channels,
+    with separate attack and release times.
+
+    The detector (the channels' peak or mean square) is built with vector operations
+    over the whole block first, so only the one-pole smoothing runs per sample.
+*/
+template <typename Type>
+class EnvelopeFollower
+{
+public:
+    //==============================================================================
+    enum Detector
+    {
+        peak,
+        rms
+    };
+
+    //==============================================================================
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        sampleRate = spec.sampleRate;
+        detectorBuffer.setSize (2, (int) spec.maximumBlockSize);
+        updateCoefficients();
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        envelope = Type (0);
+    }
+
+    //==============================================================================
+    void setDetector (Detector newValue) noexcept
+    {
+        detector = newValue;
+    }
+
+    void setAttackTime (Type newValueInMilliseconds) noexcept
+    {
+        jassert (newValueInMilliseconds > Type (0));
+        attackTime = newValueInMilliseconds;
+        updateCoefficients();
+    }
+
+    void setReleaseTime (Type newValueInMilliseconds) noexcept
+    {
+        jassert (newValueInMilliseconds > Type (0));
+        releaseTime = newValueInMilliseconds;
+        updateCoefficients();
+    }
+
+    //==============================================================================
+    /** Writes the envelope of block into output, one value per sample. Blocks longer
+        than the prepared maximum are followed in pieces.
+    */
+    template <typename OutputType>
+    void process (const juce::dsp::AudioBlock<const Type>& block, OutputType* output) noexcept
+    {
+        auto numChannels = block.getNumChannels();
+        auto maxChunkSize = (size_t) detectorBuffer.getNumSamples();
+
+        if (numChannels == 0 || maxChunkSize == 0)
+        {
+            std::fill (output, output + block.getNumSamples(), OutputType (0));
+            return;
+        }
+
+        auto* levels  = detectorBuffer.getWritePointer (0);
+        auto* scratch = detectorBuffer.getWritePointer (1);
+
+        for (size_t start = 0; start < block.getNumSamples(); start += maxChunkSize)
+        {
+            auto numSamples = (int) juce::jmin (maxChunkSize, block.getNumSamples() - start);
+
+            if (detector == peak)
+            {
+                juce::FloatVectorOperations::abs (levels, block.getChannelPointer (0) + start, numSamples);
+
+                for (size_t ch = 1; ch < numChannels; ++ch)
+                {
+                    juce::FloatVectorOperations::abs (scratch, block.getChannelPointer (ch) + start, numSamples);
+                    juce::FloatVectorOperations::max (levels, levels, scratch, numSamples);
+                }
+            }
+            else
+            {
+                auto* first = block.getChannelPointer (0) + start;
+                juce::FloatVectorOperations::multiply (levels, first, first, numSamples);
+
+                for (size_t ch = 1; ch < numChannels; ++ch)
+                {
+                    auto* channel = block.getChannelPointer (ch) + start;
+                    juce::FloatVectorOperations::addWithMultiply (levels, channel, channel, numSamples);
+                }
+
+                juce::FloatVectorOperations::multiply (levels, Type (1) / (Type) numChannels, numSamples);
+            }
+
+            for (int i = 0; i < numSamples; ++i)
+            {
+                auto coefficient = levels[i] > envelope ? attackCoefficient : releaseCoefficient;
+                envelope = levels[i] + coefficient * (envelope - levels[i]);
+
+                output[start + (size_t) i] = (OutputType) (detector == rms ? std::sqrt (envelope) : envelope);
+            }
+        }
+    }
+
+private:
+    //==============================================================================
+    void updateCoefficients() noexcept
+    {
+        auto coefficientFor = [this] (Type timeInMilliseconds)
+        {
+            return (Type) std::exp (-1.0 / (sampleRate * 0.001 * (double) timeInMilliseconds));
+        };
+
+        attackCoefficient = coefficientFor (attackTime);
+        releaseCoefficient = coefficientFor (releaseTime);
+    }
+
+    Detector detector { peak };
+    Type attackTime { Type (10) }, releaseTime { Type (150) };
+    Type attackCoefficient { Type (0) }, releaseCoefficient { Type (0) };
+    Type envelope { Type (0) };
+
+    double sampleRate { 44.1e3 };
+    juce::AudioBuffer<Type> detectorBuffer;
+};
+
+//==============================================================================
+/** Noise gate with hysteresis, hold, release and an optional lookahead.
+
+    The detector decides once per short chunk, from the chunk's peak found with
+    vector operations, and the gain ramps linearly across the chunk, so the only
+    per-sample work is applying it. With lookahead the audio is delayed behind the
+    detector, so the gate is already open when a note's attack comes through.
+*/
+template <typename Type>
+class NoiseGate
+{
+public:
+    //==============================================================================
+    static constexpr Type maxLookaheadTime = Type (10);
+    static constexpr int chunkSize = 32;
+
+    /** The delay, in samples, a lookahead time adds at a sample rate. */
+    static int getLookaheadSamples (double lookaheadTimeInMilliseconds, double sampleRate) noexcept
+    {
+        return juce::roundToInt (juce::jlimit (0.0, (double) maxLookaheadTime, lookaheadTimeInMilliseconds) * 0.001 * sampleRate);
+    }
+
+    //==============================================================================
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        sampleRate = spec.sampleRate;
+        lookaheadBuffer.setSize ((int) spec.numChannels, getLookaheadSamples (maxLookaheadTime, sampleRate) + chunkSize);
+        updateTimes();
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        lookaheadBuffer.clear();
+        writePosition = 0;
+        open = ! enabled;
+        gain = open ? Type (1) : Type (0);
+        holdRemaining = 0;
+        silent = ! open;
+    }
+
+    //==============================================================================
+    /** A disabled gate stays open, but still delays by its lookahead. */
+    void setEnabled (bool shouldBeEnabled) noexcept
+    {
+        enabled = shouldBeEnabled;
+    }
+
+    void setThreshold (Type newValueInDecibels) noexcept
+    {
+        thresholdInDecibels = newValueInDecibels;
+        updateThresholds();
+    }
+
+    /** How far below the threshold the level has to fall before the gate closes again. */
+    void setHysteresis (Type newValueInDecibels) noexcept
+    {
+        hysteresisInDecibels = juce::jmax (Type (0), newValueInDecibels);
+        updateThresholds();
+    }
+
+    void setHoldTime (Type newValueInMilliseconds) noexcept
+    {
+        holdTime = juce::jmax (Type (0), newValueInMilliseconds);
+        updateTimes();
+    }
+
+    void setReleaseTime (Type newValueInMilliseconds) noexcept
+    {
+        jassert (newValueInMilliseconds > Type (0));
+        releaseTime = newValueInMilliseconds;
+        updateTimes();
+    }
+
+    void setLookaheadTime (Type newValueInMilliseconds) noexcept
+    {
+        lookaheadTime = newValueInMilliseconds;
+        updateTimes();
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return lookaheadSamples;
+    }
+
+    /** True if the last block came out as silence, with the gate shut and its release finished. */
+    bool isSilent() const noexcept
+    {
+        return silent;
+    }
+
+    //==============================================================================
+    template <typename ProcessContext>
+    void process (const ProcessContext& context) noexcept
+    {
+        auto& inputBlock  = context.getInputBlock();
+        auto& outputBlock = context.getOutputBlock();
+        auto numChannels = juce::jmin (outputBlock.getNumChannels(), (size_t) lookaheadBuffer.getNumChannels());
+
+        if (context.usesSeparateInputAndOutputBlocks())
+            outputBlock.copyFrom (inputBlock);
+
+        silent = true;
+
+        for (size_t start = 0; start < outputBlock.getNumSamples(); start += chunkSize)
+        {
+            auto numSamples = (int) juce::jmin ((size_t) chunkSize, outputBlock.getNumSamples() - start);
+
+            auto level = Type (0);
+
+            for (size_t ch = 0; ch < numChannels; ++ch)
+            {
+                Type minimum, maximum;
+                juce::FloatVectorOperations::findMinAndMax (outputBlock.getChannelPointer (ch) + start, numSamples, minimum, maximum);
+                level = juce::jmax (level, -minimum, maximum);
+            }
+
+            auto startGain = gain;
+            updateGain (level, numSamples);
+
+            for (size_t ch = 0; ch < numChannels; ++ch)
+            {
+                auto* data = outputBlock.getChannelPointer (ch) + start;
+
+                if (lookaheadSamples > 0)
+                    delay (data, (int) ch, numSamples);
+
+                applyGainRamp (data, startGain, gain, numSamples);
+            }
+
+            writePosition = (writePosition + numSamples) % lookaheadBuffer.getNumSamples();
+            silent = silent && startGain == Type (0) && gain == Type (0);
+        }
+    }
+
+private:
+    //==============================================================================
+    void updateGain (Type level, int numSamples) noexcept
+    {
+        // hysteresis: an open gate only has to stay above the lower threshold
+        if (! enabled || level >= (open ? closeThreshold : openThreshold))
+        {
+            open = true;
+            holdRemaining = holdSamples;
+        }
+        else if (open)
+        {
+            holdRemaining -= numSamples;
+
+            if (holdRemaining <= 0)
+                open = false;
+        }
+
+        if (open)
+        {
+            gain = juce::jmin (Type (1), gain + attackStep * (Type) numSamples);
+        }
+        else
+        {
+            gain *= std::pow (releaseCoefficient, (Type) numSamples);
+
+            // below -80 dB the release counts as finished
+            if (gain < Type (1.0e-4))
+                gain = Type (0);
+        }
+    }
+
+    void delay (Type* data, int channel, int numSamples) noexcept
+    {
+        auto size = lookaheadBuffer.getNumSamples();
+        auto* line = lookaheadBuffer.getWritePointer (channel);
+
+        // the line is at least a chunk longer than the lookahead, so the write can't reach what's read back
+        auto firstPart = juce::jmin (numSamples, size - writePosition);
+        juce::FloatVectorOperations::copy (line + writePosition, data, firstPart);
+        juce::FloatVectorOperations::copy (line, data + firstPart, numSamples - firstPart);
+
+        auto readPosition = (writePosition - lookaheadSamples + size) % size;
+
+        firstPart = juce::jmin (numSamples, size - readPosition);
+        juce::FloatVectorOperations::copy (data, line + readPosition, firstPart);
+        juce::FloatVectorOperations::copy (data + firstPart, line, numSamples - firstPart);
+    }
+
+    static void applyGainRamp (Type* data, Type startGain, Type endGain, int numSamples) noexcept
+    {
+        if (startGain == endGain)
+        {
+            if (endGain == Type (0))
+                juce::FloatVectorOperations::clear (data, numSamples);
+            else if (endGain != Type (1))
+                juce::FloatVectorOperations::multiply (data, endGain, numSamples);
+
+            return;
+        }
+
+        auto step = (endGain - startGain) / (Type) numSamples;
+
+        for (int i = 0; i < numSamples; ++i)
+            data[i] *= startGain + step * (Type) (i + 1);
+    }
+
+    void updateThresholds() noexcept
+    {
+        openThreshold = juce::Decibels::decibelsToGain (thresholdInDecibels);
+        closeThreshold = juce::Decibels::decibelsToGain (thresholdInDecibels - hysteresisInDecibels);
+    }
+
+    void updateTimes() noexcept
+    {
+        holdSamples = juce::roundToInt (sampleRate * 0.001 * (double) holdTime);
+        attackStep = (Type) (1.0 / (sampleRate * 0.001 * attackTime));
+        releaseCoefficient = (Type) std::exp (-1.0 / (sampleRate * 0.001 * (double) releaseTime));
+
+        auto newLookaheadSamples = getLookaheadSamples ((double) lookaheadTime, sampleRate);
+
+        if (newLookaheadSamples + chunkSize <= lookaheadBuffer.getNumSamples())
+            lookaheadSamples = newLookaheadSamples;
+    }
+
+    // short enough not to soften a pick attack, long enough not to click
+    static constexpr double attackTime = 1.0;
+
+    bool enabled { true }, open { false }, silent { true };
+    Type thresholdInDecibels { Type (-60) }, hysteresisInDecibels { Type (6) };
+    Type holdTime { Type (50) }, releaseTime { Type (100) }, lookaheadTime { Type (0) };
+    Type openThreshold { Type (0.001) }, closeThreshold { Type (0.0005) };
+    Type attackStep { Type (0) }, releaseCoefficient { Type (0) }, gain { Type (0) };
+    int holdSamples { 0 }, holdRemaining { 0 }, lookaheadSamples { 0 };
+
+    juce::AudioBuffer<Type> lookaheadBuffer;
+    int writePosition { 0 };
+    double sampleRate { 44.1e3 };
+};
+
+//==============================================================================
+/** Running maximum of the last few values pushed, kept in a monotonic deque.
+
+    A value that arrives larger than older ones means those older ones can never
+    be the maximum again, so they're dropped, and the deque stays in decreasing
+    order with the maximum at its front. Each value goes in once and comes out at
+    most once, so a push costs O(1) amortised however long the window is.
+*/
+template <typename Type>
+class SlidingMaximum
+{
+public:
+    //==============================================================================
+    void setWindowLength (int newWindowLength)
+    {
+        windowLength = juce::jmax (1, newWindowLength);
+        values.resize ((size_t) windowLength);
+        times.resize ((size_t) windowLength);
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        front = 0;
+        size = 0;
+        time = 0;
+    }
+
+    /** Adds a value and returns the maximum of the window ending with it. */
+    Type push (Type value) noexcept
+    {
+        // times are all different, so at most one value can have left the window
+        if (size > 0 && times[(size_t) front] <= time - windowLength)
+        {
+            front = (front + 1) % windowLength;
+            --size;
+        }
+
+        while (size > 0 && values[(size_t) ((front + size - 1) % windowLength)] <= value)
+            --size;
+
+        auto back = (size_t) ((front + size) % windowLength);
+        values[back] = value;
+        times[back] = time;
+
+        ++size;
+        ++time;
+
+        return values[(size_t) front];
+    }
+
+private:
+    //==============================================================================
+    std::vector<Type> values;
+    std::vector<juce::int64> times;
+    int windowLength { 1 }, front { 0 }, size { 0 };
+    juce::int64 time { 0 };
+};
+
+//==============================================================================
+/** Lookahead brickwall limiter with a true-peak ceiling, linked across channels.
+
+    The detector estimates the peaks between samples as well as on them, from the
+    signal interpolated to four times the rate by a polyphase filter. The gain it
+    needs is held over the lookahead by a sliding maximum of the peaks and smoothed
+    into a ramp by a moving average as long as the attack, while the audio is
+    delayed to match, so the gain is already down when a peak comes through and it
+    never ramps past one. It then recovers with an exponential release.
+*/
+template <typename Type>
+class TruePeakLimiter
+{
+public:
+    //==============================================================================
+    static constexpr int oversamplingFactor = 4;
+    static constexpr int tapsPerPhase = 12;
+
+    /** The delay, in samples, the limiter adds at a sample rate. */
+    static int getLatencySamples (double sampleRate) noexcept
+    {
+        // the attack ramp, plus the interpolator's reach behind the newest sample
+        return getAttackSamples (sampleRate) + tapsPerPhase - 2;
+    }
+
+    //==============================================================================
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        sampleRate = spec.sampleRate;
+        attackSamples = getAttackSamples (sampleRate);
+        latencySamples = getLatencySamples (sampleRate);
+
+        delayBuffer.setSize ((int) spec.numChannels, latencySamples);
+        detectorHistory.setSize ((int) spec.numChannels, 2 * tapsPerPhase);
+        attackGains.resize ((size_t) attackSamples);
+
+        // a peak has to be seen from when it enters the attack ramp until the last sample it came from is out
+        peakMaximum.setWindowLength (latencySamples + 1);
+
+        designInterpolator();
+        updateRelease();
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        delayBuffer.clear();
+        detectorHistory.clear();
+        peakMaximum.reset();
+        std::fill (attackGains.begin(), attackGains.end(), Type (1));
+
+        delayPosition = 0;
+        historyPosition = 0;
+        attackPosition = 0;
+        gain = Type (1);
+    }
+
+    //==============================================================================
+    void setCeiling (Type newValueInDecibels) noexcept
+    {
+        ceiling = juce::Decibels::decibelsToGain (newValueInDecibels);
+    }
+
+    void setReleaseTime (Type newValueInMilliseconds) noexcept
+    {
+        jassert (newValueInMilliseconds > Type (0));
+        releaseTime = newValueInMilliseconds;
+        updateRelease();
+    }
+
+    //==============================================================================
+    template <typename ProcessContext>
+    void process (const ProcessContext& context) noexcept
+    {
+        auto& inputBlock  = context.getInputBlock();
+        auto& outputBlock = context.getOutputBlock();
+        auto numChannels = juce::jmin (outputBlock.getNumChannels(), (size_t) delayBuffer.getNumChannels());
+
+        if (context.usesSeparateInputAndOutputBlocks())
+            outputBlock.copyFrom (inputBlock);
+
+        // summed afresh each block, so rounding can't build up in the running sum
+        auto attackSum = std::accumulate (attackGains.begin(), attackGains.end(), 0.0);
+
+        for (size_t i = 0; i < outputBlock.getNumSamples(); ++i)
+        {
+            auto peak = Type (0);
+
+            for (size_t ch = 0; ch < numChannels; ++ch)
+            {
+                auto& sample = outputBlock.getChannelPointer (ch)[i];
+                auto* line = delayBuffer.getWritePointer ((int) ch);
+
+                peak = juce::jmax (peak, detectTruePeak ((int) ch, sample));
+
+                auto delayed = line[delayPosition];
+                line[delayPosition] = sample;
+                sample = delayed;
+            }
+
+            auto maximum = peakMaximum.push (peak);
+            auto required = maximum > ceiling ? ceiling / maximum : Type (1);
+
+            attackSum += (double) (required - attackGains[(size_t) attackPosition]);
+            attackGains[(size_t) attackPosition] = required;
+            attackPosition = (attackPosition + 1) % attackSamples;
+
+            auto target = (Type) (attackSum / attackSamples);
+
+            // down at once to the ramp, which already started ahead of the peak; back up at the release rate
+            gain = target < gain ? target : target + releaseCoefficient * (gain - target);
+
+            for (size_t ch = 0; ch < numChannels; ++ch)
+                outputBlock.getChannelPointer (ch)[i] *= gain;
+
+            delayPosition = (delayPosition + 1) % latencySamples;
+            historyPosition = (historyPosition + 1) % tapsPerPhase;
+        }
+    }
+
+private:
+    //==============================================================================
+    static int getAttackSamples (double sampleRate) noexcept
+    {
+        return juce::jmax (1, juce::roundToInt (attackTime * 0.001 * sampleRate));
+    }
+
+    /** The largest of the newest sample and the four points interpolated half the taps behind it. */
+    Type detectTruePeak (int channel, Type input) noexcept
+    {
+        // each sample is written twice, so the newest taps are always in one straight run
+        auto* history = detectorHistory.getWritePointer (channel);
+        history[historyPosition] = input;
+        history[historyPosition + tapsPerPhase] = input;
+
+        auto* taps = history + historyPosition + 1;
+        auto peak = std::abs (input);
+
+        for (auto& phase : interpolatorPhases)
+        {
+            auto interpolated = Type (0);
+
+            for (int k = 0; k < tapsPerPhase; ++k)
+                interpolated += phase[(size_t) k] * taps[k];
+
+            peak = juce::jmax (peak, std::abs (interpolated));
+        }
+
+        return peak;
+    }
+
+    /** Splits a Blackman windowed sinc at the original Nyquist frequency into its phases,
+        each scaled to unity gain at DC and ordered oldest tap first.
+    */
+    void designInterpolator() noexcept
+    {
+        constexpr int length = oversamplingFactor * tapsPerPhase;
+        constexpr double centre = 0.5 * (length - 1);
+
+        for (int phase = 0; phase < oversamplingFactor; ++phase)
+        {
+            auto& coefficients = interpolatorPhases[(size_t) phase];
+            auto sum = 0.0;
+
+            for (int k = 0; k < tapsPerPhase; ++k)
+            {
+                auto n = phase + oversamplingFactor * k;
+                auto x = (n - centre) / oversamplingFactor;
+                auto sinc = x == 0.0 ? 1.0 : std::sin (juce::MathConstants<double>::pi * x) / (juce::MathConstants<double>::pi * x);
+                auto w = juce::MathConstants<double>::twoPi * n / (length - 1);
+                auto window = 0.42 - 0.5 * std::cos (w) + 0.08 * std::cos (2.0 * w);
+
+                coefficients[(size_t) (tapsPerPhase - 1 - k)] = (Type) (sinc * window);
+                sum += sinc * window;
+            }
+
+            for (auto& c : coefficients)
+                c = (Type) (c / sum);
+        }
+    }
+
+    void updateRelease() noexcept
+    {
+        releaseCoefficient = (Type) std::exp (-1.0 / (sampleRate * 0.001 * (double) releaseTime));
+    }
+
+    // long enough that the ramp down doesn't buzz, short enough to keep the latency out of the way
+    static constexpr double attackTime = 1.5;
+
+    std::array<std::array<Type, tapsPerPhase>, oversamplingFactor> interpolatorPhases {};
+    juce::AudioBuffer<Type> detectorHistory, delayBuffer;
+    SlidingMaximum<Type> peakMaximum;
+    std::vector<Type> attackGains;
+
+    Type ceiling { Type (1) }, releaseTime { Type (100) }, releaseCoefficient { Type (0) }, gain { Type (1) };
+    int attackSamples { 1 }, latencySamples { 1 };
+    int delayPosition { 0 }, historyPosition { 0 }, attackPosition { 0 };
+    double sampleRate { 44.1e3 };
+};
+
+//==============================================================================
+/** Low frequency oscillator rendered a block at a time.
+
+    The block's phase ramp is written out first and the periodic shapes are then
+    branch-free functions of it, so their loops vectorise. The random shapes only
+    need to notice the phase wrapping to pick their next value.
+*/
+template <typename Type>
+class Lfo
+{
+public:
+    //==============================================================================
+    enum Shape
+    {
+        sine,
+        triangle,
+        sampleAndHold,
+        smoothRandom
+    };
+
+    //==============================================================================
+    void prepare (double newSampleRate) noexcept
+    {
+        sampleRate = newSampleRate;
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        phase = Type (0);
+        previousValue = Type (0);
+        nextValue = randomValue();
+    }
+
+    //==============================================================================
+    void setShape (Shape newValue) noexcept
+    {
+        shape = newValue;
+    }
+
+    void setFrequency (Type newValueInHz) noexcept
+    {
+        jassert (newValueInHz >= Type (0));
+        frequency = newValueInHz;
+    }
+
+    /** Moves the phase, in cycles from 0 to 1, e.g. to lock to the host's position. */
+    void setPhase (Type newValue) noexcept
+    {
+        phase = newValue - std::floor (newValue);
+    }
+
+    //==============================================================================
+    /** Writes the next numSamples values, between -1 and 1, into output. */
+    void render (Type* output, int numSamples) noexcept
+    {
+        auto increment = (Type) (frequency / sampleRate);
+
+        switch (shape)
+        {
+            case sine:
+            {
+                // parabolic sine, accurate to about 0.1%, of u = 2 frac (phase) - 1, where sin (2 pi t) = -sin (pi u)
+                for (int i = 0; i < numSamples; ++i)
+                {
+                    auto t = phase + increment * (Type) i;
+                    auto u = Type (2) * (t - std::floor (t)) - Type (1);
+                    auto y = Type (4) * u * (Type (1) - std::abs (u));
+                    output[i] = -(y + Type (0.225) * (y * std::abs (y) - y));
+                }
+
+                setPhase (phase + increment * (Type) numSamples);
+                break;
+            }
+            case triangle:
+            {
+                for (int i = 0; i < numSamples; ++i)
+                {
+                    auto t = phase + increment * (Type) i + Type (0.25);
+                    output[i] = Type (1) - Type (4) * std::abs (t - std::floor (t) - Type (0.5));
+                }
+
+                setPhase (phase + increment * (Type) numSamples);
+                break;
+            }
+            case sampleAndHold:
+            case smoothRandom:
+            default:
+            {
+                auto t = phase;
+
+                for (int i = 0; i < numSamples; ++i)
+                {
+                    if (t >= Type (1))
+                    {
+                        t -= std::floor (t);
+                        previousValue = nextValue;
+                        nextValue = randomValue();
+                    }
+
+                    auto ramp = t * t * (Type (3) - Type (2) * t);
+                    output[i] = shape == sampleAndHold ? nextValue : previousValue + ramp * (nextValue - previousValue);
+
+                    t += increment;
+                }
+
+                // left unwrapped, so a wrap landing on the block boundary still picks a new value
+                phase = t;
+                break;
+            }
+        }
+    }
+
+private:
+    //==============================================================================
+    Type randomValue() noexcept
+    {
+        return Type (2) * (Type) random.nextFloat() - Type (1);
+    }
+
+    Shape shape { sine };
+    Type frequency { Type (1) };
+    Type phase { Type (0) };
+    Type previousValue { Type (0) }, nextValue { Type (0) };
+
+    double sampleRate { 44.1e3 };
+    juce::Random random;
+};
+
+//==============================================================================
+/** Lock-free single-producer / single-consumer handoff of the newest value.
+    The writer never waits for the reader and the reader always sees a complete
+    value; values published in between two reads are skipped.
+*/
+template <typename Type>
+class TripleBuffer
+{
+public:
+    /** Producer side: the slot to fill in before calling publish(). */
+    Type& getWriteBuffer() noexcept
+    {
+        return buffers[(size_t) writeIndex];
+    }
+
+    /** Producer side: hands the write buffer over to the reader. */
+    void publish() noexcept
+    {
+        writeIndex = shared.exchange (writeIndex | newDataFlag, std::memory_order_acq_rel) & indexMask;
+    }
+
+    /** Producer side: publishes a copy of newValue. */
+    void write (const Type& newValue) noexcept
+    {
+        getWriteBuffer() = newValue;
+        publish();
+    }
+
+    /** Consumer side: returns the newest published value, or nullptr if nothing
+        was published since the last call. The pointer stays valid until the next call.
+    */
+    const Type* acquire() noexcept
+    {
+        if ((shared.load (std::memory_order_relaxed) & newDataFlag) == 0)
+            return nullptr;
+
+        readIndex = shared.exchange (readIndex, std::memory_order_acq_rel) & indexMask;
+        return &buffers[(size_t) readIndex];
+    }
+
+    /** Consumer side: copies the newest published value into dest, returning false if there was none. */
+    bool read (Type& dest) noexcept
+    {
+        if (auto* newest = acquire())
+        {
+            dest = *newest;
+            return true;
+        }
+
+        return false;
+    }
+
+private:
+    static constexpr int indexMask = 3, newDataFlag = 4;
+
+    std::array<Type, 3> buffers {};
+    int writeIndex = 0, readIndex = 1;
+    std::atomic<int> shared { 2 };
+};
+
+//==============================================================================
+/** Ring buffer holding numChannels samples per frame, interleaved, so that a
+    multichannel delay reads and writes all of its channels from one cache line.
+*/
+template <typename Type, size_t numChannels = 1>
+class DelayLine
+{
+public:
+    void clear() noexcept
+    {
+        std::fill (rawData.begin(), rawData.end(), Type (0));
+    }
+
+    size_t size() const noexcept
+    {
+        return numFrames;
+    }
+
+    void resize (size_t newValue)
+    {
+        rawData.resize (newValue * numChannels);
+        numFrames = newValue;
+        leastRecentIndex = 0;
+    }
+
+    /** Takes over newData as the line's storage and hands back the previous storage,
+        so that memory can be moved in and out without the line allocating anything.
+    */
+    std::vector<Type> exchangeStorage (std::vector<Type>&& newData) noexcept
+    {
+        jassert (newData.size() % numChannels == 0);
+
+        std::swap (rawData, newData);
+        numFrames = rawData.size() / numChannels;
+        leastRecentIndex = 0;
+
+        return std::move (newData);
+    }
+
+    Type back (size_t channel = 0) const noexcept
+    {
+        return rawData[leastRecentIndex * numChannels + channel];
+    }
+
+    Type get (size_t delayInSamples, size_t channel = 0) const noexcept
+    {
+        jassert (delayInSamples >= 0 && delayInSamples < size());
+        jassert (channel < numChannels);
+ 
+        return rawData[((leastRecentIndex + 1 + delayInSamples) % size()) * numChannels + channel];   // [3]
+    }
+
+    /** Reads a fractional delay, linearly interpolated. delayInSamples must be below size() - 1. */
+    Type getInterpolated (Type delayInSamples, size_t channel = 0) const noexcept
+    {
+        jassert (delayInSamples >= Type (0) && delayInSamples < (Type) (size() - 1));
+
+        auto whole = (size_t) delayInSamples;
+        auto fraction = delayInSamples - (Type) whole;
+
+        auto a = get (whole, channel);
+        auto b = get (whole + 1, channel);
+
+        return a + fraction * (b - a);
+    }
+
+    /** Adds numFrames consecutive samples of one channel to output, oldest first: output[0]
+        gets get (delayInSamples), output[i] gets get (delayInSamples - i). The storage runs
+        from newest to oldest, so this is a plain walk backwards through memory that wraps
+        at most once, with no modulo per sample.
+    */
+    void addSequence (size_t delayInSamples, size_t numFrames, Type* output, size_t channel = 0) const noexcept
+    {
+        jassert (delayInSamples < size() && numFrames <= delayInSamples + 1);
+        jassert (channel < numChannels);
+
+        auto index = (leastRecentIndex + 1 + delayInSamples) % size();
+
+        for (size_t i = 0; i < numFrames; ++i)
+        {
+            output[i] += rawData[index * numChannels + channel];
+            index = index == 0 ? size() - 1 : index - 1;
+        }
+    }
+
+    /** Like addSequence(), but overwrites output rather than adding to it. */
+    void copySequence (size_t delayInSamples, size_t numFrames, Type* output, size_t channel = 0) const noexcept
+    {
+        jassert (delayInSamples < size() && numFrames <= delayInSamples + 1);
+        jassert (channel < numChannels);
+
+        auto index = (leastRecentIndex + 1 + delayInSamples) % size();
+
+        for (size_t i = 0; i < numFrames; ++i)
+        {
+            output[i] = rawData[index * numChannels + channel];
+            index = index == 0 ? size() - 1 : index - 1;
+        }
+    }
+
+    /** Copies numFrames consecutive samples of one channel, newest first: output[i] gets
+        get (delayInSamples + i). A plain walk forwards through memory, wrapping at most once.
+    */
+    void copyReversedSequence (size_t delayInSamples, size_t numFrames, Type* output, size_t channel = 0) const noexcept
+    {
+        jassert (delayInSamples + numFrames <= size());
+        jassert (channel < numChannels);
+
+        auto index = (leastRecentIndex + 1 + delayInSamples) % size();
+
+        for (size_t i = 0; i < numFrames; ++i)
+        {
+            output[i] = rawData[index * numChannels + channel];
+            index = index + 1 == size() ? 0 : index + 1;
+        }
+    }
+
+    /** Set the specified sample in the delay line */
+    void set (size_t delayInSamples, Type newValue, size_t channel = 0) noexcept
+    {
+        jassert (delayInSamples >= 0 && delayInSamples < size());
+        jassert (channel < numChannels);
+ 
+        rawData[((leastRecentIndex + 1 + delayInSamples) % size()) * numChannels + channel] = newValue; // [4]
+    }
+
+    /** Adds a new value to a mono delay line, overwriting the least recently added sample */
+    void push (Type valueToAdd) noexcept
+    {
+        jassert (numChannels == 1);
+
+        rawData[leastRecentIndex] = valueToAdd;                                         // [1]
+        advance();
+    }
+
+    /** Adds a new frame holding one sample per channel, overwriting the least recently added frame */
+    void pushFrame (const Type* frame) noexcept
+    {
+        std::copy (frame, frame + numChannels, rawData.begin() + (std::ptrdiff_t) (leastRecentIndex * numChannels));
+        advance();
+    }
+
+private:
+    std::vector<Type> rawData;
+    size_t numFrames = 0;
+    size_t leastRecentIndex = 0;
+
+    void advance() noexcept
+    {
+        leastRecentIndex = leastRecentIndex == 0 ? size() - 1 : leastRecentIndex - 1;   // [2]
+    }
+};
+
+//==============================================================================
+/** Free list of delay buffers shared by every instance in the process (use it
+    through a juce::SharedResourcePointer). Delays hand their memory back here
+    when they stay bypassed and the next delay to be enabled reuses it, so a
+    session full of idle delays neither holds nor churns large allocations.
+*/
+template <typename Type>
+class DelayMemoryPool
+{
+public:
+    using Block = std::vector<Type>;
+
+    /** Returns a zeroed block of numElements, reusing the best fitting free block if there is one. */
+    Block acquire (size_t numElements)
+    {
+        {
+            const juce::ScopedLock sl (lock);
+
+            auto best = freeBlocks.end();
+
+            for (auto it = freeBlocks.begin(); it != freeBlocks.end(); ++it)
+                if (it->capacity() >= numElements
+                     && (best == freeBlocks.end() || it->capacity() < best->capacity()))
+                    best = it;
+
+            if (best != freeBlocks.end())
+            {
+                auto block = std::move (*best);
+                freeBlocks.erase (best);
+                retainedElements -= block.capacity();
+
+                block.assign (numElements, Type (0));
+                return block;
+            }
+        }
+
+        return Block (numElements, Type (0));
+    }
+
+    /** Keeps the block for later reuse, or frees it if the pool is already holding its budget. */
+    void release (Block block)
+    {
+        if (block.capacity() == 0)
+            return;
+
+        const juce::ScopedLock sl (lock);
+
+        if (retainedElements + block.capacity() > maxRetainedBytes / sizeof (Type))
+            return;
+
+        retainedElements += block.capacity();
+        freeBlocks.push_back (std::move (block));
+    }
+
+    void setMaxRetainedBytes (size_t newValue)
+    {
+        const juce::ScopedLock sl (lock);
+        maxRetainedBytes = newValue;
+
+        while (! freeBlocks.empty() && retainedElements > maxRetainedBytes / sizeof (Type))
+        {
+            retainedElements -= freeBlocks.back().capacity();
+            freeBlocks.pop_back();
+        }
+    }
+
+private:
+    juce::CriticalSection lock;
+    std::vector<Block> freeBlocks;
+    size_t retainedElements = 0;
+    size_t maxRetainedBytes = 32 * 1024 * 1024;
+};
+
+//==============================================================================
+/** A small feedback delay network for smearing the delay's repeats into a wash.
+
+    Four short lines are mixed back into each other through a Hadamard matrix,
+    which is orthogonal, so the decay alone sets how long the smear lasts. The
+    lines are kept as the lanes of a fixed-size array so the mixing is plain
+    vector arithmetic, and each line has a power-of-two buffer, allocated by
+    prepare(), that is indexed with a mask. One channel per instance.
+*/
+template <typename Type>
+class FeedbackDiffuser
+{
+public:
+    //==============================================================================
+    static constexpr size_t numLines = 4;
+
+    using Lanes = std::array<Type, numLines>;
+
+    //==============================================================================
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        // mutually prime-ish lengths, so the lines' echoes don't line up
+        static constexpr double lineTimes[] { 0.0097, 0.0143, 0.0211, 0.0293 };
+
+        size_t longest = 0;
+
+        for (size_t k = 0; k < numLines; ++k)
+        {
+            lengths[k] = (size_t) juce::jmax (1, juce::roundToInt (lineTimes[k] * spec.sampleRate));
+            longest = juce::jmax (longest, lengths[k]);
+        }
+
+        auto size = (size_t) juce::nextPowerOfTwo ((int) longest + 1);
+
+        for (auto& line : lines)
+            line.assign (size, Type (0));
+
+        mask = size - 1;
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        for (auto& line : lines)
+            std::fill (line.begin(), line.end(), Type (0));
+
+        writeIndex = 0;
+    }
+
+    //==============================================================================
+    /** How much of the signal goes through the network, 0 to 1. */
+    void setAmount (Type newValue) noexcept
+    {
+        jassert (newValue >= Type (0) && newValue <= Type (1));
+        amount = newValue;
+    }
+
+    /** The network's own feedback, below 1. */
+    void setDecay (Type newValue) noexcept
+    {
+        jassert (newValue >= Type (0) && newValue < Type (1));
+        decay = newValue;
+
+        // keeps the wet level close to the dry one as the smear gets longer
+        normalisation = std::sqrt (Type (1) - decay * decay);
+    }
+
+    bool isActive() const noexcept
+    {
+        return amount > Type (0) && ! lines[0].empty();
+    }
+
+    //==============================================================================
+    Type processSample (Type x) noexcept
+    {
+        Lanes outputs;
+
+        for (size_t k = 0; k < numLines; ++k)
+            outputs[k] = lines[k][(writeIndex - lengths[k]) & mask];
+
+        // 4 point fast Hadamard transform, scaled by 1/2 to stay orthogonal
+        auto a = outputs[0] + outputs[1], b = outputs[0] - outputs[1];
+        auto c = outputs[2] + outputs[3], d = outputs[2] - outputs[3];
+        Lanes mixed { a + c, b + d, a - c, b - d };
+
+        for (size_t k = 0; k < numLines; ++k)
+            lines[k][writeIndex] = Type (0.5) * (x + decay * mixed[k]);
+
+        writeIndex = (writeIndex + 1) & mask;
+
+        auto wet = Type (0.5) * normalisation * (outputs[0] + outputs[1] + outputs[2] + outputs[3]);
+        return x + amount * (wet - x);
+    }
+
+private:
+    //==============================================================================
+    std::array<std::vector<Type>, numLines> lines;
+    std::array<size_t, numLines> lengths {};
+    size_t mask { 0 }, writeIndex { 0 };
+
+    Type amount { Type (0) }, decay { Type (0.5) }, normalisation { std::sqrt (Type (0.75)) };
+};
+
+//==============================================================================
+/** Pitch shifter for the delay's feedback path, with no FFT and nothing to wait for.
+
+    Two read heads sweep a short window of a small ring buffer at the shifted speed,
+    half a window apart. Each head's delay ramps across the window and jumps back to
+    the other end when it runs out, and triangular windows, which sum to one, fade a
+    head out before it jumps. The buffer has a power-of-two size, allocated by
+    prepare(), and is indexed with a mask. One channel per instance.
+*/
+template <typename Type>
+class PitchShifter
+{
+public:
+    //==============================================================================
+    static constexpr Type maxSemitones = Type (12);
+
+    //==============================================================================
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        // long enough to hold a low note's period, short enough not to smear into an echo
+        windowLength = (Type) (0.05 * spec.sampleRate);
+
+        auto size = (size_t) juce::nextPowerOfTwo ((int) windowLength + 4);
+        buffer.assign (size, Type (0));
+        mask = size - 1;
+
+        updateIncrement();
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        std::fill (buffer.begin(), buffer.end(), Type (0));
+        writeIndex = 0;
+        phase = Type (0);
+    }
+
+    //==============================================================================
+    void setSemitones (Type newValue) noexcept
+    {
+        jassert (std::abs (newValue) <= maxSemitones);
+        semitones = juce::jlimit (-maxSemitones, maxSemitones, newValue);
+        updateIncrement();
+    }
+
+    bool isActive() const noexcept
+    {
+        return semitones != Type (0) && ! buffer.empty();
+    }
+
+    //==============================================================================
+    Type processSample (Type x) noexcept
+    {
+        buffer[writeIndex] = x;
+
+        auto otherPhase = phase + Type (0.5);
+        otherPhase -= std::floor (otherPhase);
+
+        auto y = readHead (phase) + readHead (otherPhase);
+
+        phase += increment;
+        phase -= std::floor (phase);
+        writeIndex = (writeIndex + 1) & mask;
+
+        return y;
+    }
+
+private:
+    //==============================================================================
+    Type readHead (Type headPhase) const noexcept
+    {
+        auto delay = Type (1) + headPhase * windowLength;
+        auto position = (Type) (writeIndex + buffer.size()) - delay;
+
+        auto whole = (size_t) position;
+        auto fraction = position - (Type) whole;
+
+        auto a = buffer[whole & mask];
+        auto b = buffer[(whole + 1) & mask];
+
+        auto gain = Type (1) - std::abs (Type (2) * headPhase - Type (1));
+        return gain * (a + fraction * (b - a));
+    }
+
+    void updateIncrement() noexcept
+    {
+        // the heads read at the shifted speed when their delay changes by 1 - ratio per sample
+        auto ratio = std::exp2 (semitones / Type (12));
+        increment = windowLength > Type (0) ? (Type (1) - ratio) / windowLength : Type (0);
+    }
+
+    std::vector<Type> buffer;
+    size_t mask { 0 }, writeIndex { 0 };
+
+    Type semitones { Type (0) }, windowLength { Type (0) };
+    Type phase { Type (0) }, increment { Type (0) };
+};
+
+//==============================================================================
+enum DelayRouting
+{
+    Routing_Stereo,
+    Routing_PingPong,
+    Routing_CrossFeed
+};
+
+//==============================================================================
+enum DelayPlayback
+{
+    Playback_Forward,
+    Playback_Freeze,    // stops writing and loops the last delay time of the line
+    Playback_Reverse    // plays delay-time-long segments of the line backwards
+};
+
+//==============================================================================
+/** Feedback delay processing all of its channels in one pass, so the feedback
+    paths can be mixed through a matrix (ping-pong, cross-feed) before being
+    written back into a shared interleaved DelayLine.
+
+    The line's memory is not allocated by prepare(): the owner moves it in and
+    out from a DelayMemoryPool with allocate() / release() on a non-realtime
+    thread. Until it has memory the delay passes its input through untouched.
+*/
+template <typename Type, size_t maxNumChannels = 1>
+class Delay
+{
+public:
+    //==============================================================================
+    /** Extra output taps read from the same line as the feedback tap; see setTap(). */
+    static constexpr size_t maxNumTaps = 8;
+
+    /** Feedback goes past 1 for self-oscillation, which the feedback compressor keeps in check. */
+    static constexpr Type maxFeedback = Type (1.5);
+
+    //==============================================================================
+    Delay()
+    {
+        // the line itself is only sized, from the pool, by allocate()
+        delayTimes.fill (Type (0));
+        delayTimesSample.fill (0);
+        updateMatrices();
+    }
+
+    //==============================================================================
+    void prepare (const juce::dsp::ProcessSpec& spec)
+    {
+        jassert (spec.numChannels <= maxNumChannels);
+        sampleRate = (Type) spec.sampleRate;
+        updateDelayTime();
+
+        lowCutCoefficients = juce::dsp::IIR::Coefficients<Type>::makeFirstOrderHighPass (sampleRate, lowCutFreq);
+        highCutCoefficients = juce::dsp::IIR::Coefficients<Type>::makeFirstOrderLowPass (sampleRate, highCutFreq);
+        designedLowCutFreq = lowCutFreq;
+        designedHighCutFreq = highCutFreq;
+
+        auto monoSpec = spec;
+        monoSpec.numChannels = 1;
+
+        for (auto& f : lowCutFilters)
+        {
+            f.prepare (monoSpec);
+            f.coefficients = lowCutCoefficients;
+        }
+        
+        for (auto& f : highCutFilters)
+        {
+            f.prepare (monoSpec);
+            f.coefficients = highCutCoefficients;
+        }
+
+        for (auto& d : distortions)
+            d.prepare (monoSpec);
+
+        for (auto& diffuser : diffusers)
+            diffuser.prepare (monoSpec);
+
+        for (auto& shifter : pitchShifters)
+            shifter.prepare (monoSpec);
+
+        tapBuffer.assign (spec.maximumBlockSize, Type (0));
+        updateTaps();
+
+        // one block per channel, plus one for the second reverse head
+        playbackBlockSize = spec.maximumBlockSize;
+        playbackBuffer.assign ((maxNumChannels + 1) * playbackBlockSize, Type (0));
+        playbackPhases.fill (0);
+
+        duckFollower.prepare (spec);
+        duckFollower.setAttackTime (Type (1));
+        duckFollower.setReleaseTime (duckReleaseTime);
+        duckGains.assign (spec.maximumBlockSize, Type (1));
+
+        feedbackEnvelopeCoefficient = (Type) (1.0 - std::exp (-1.0 / (spec.sampleRate * 0.001 * feedbackDetectorTime)));
+        feedbackPower = Type (0);
+    }
+
+    //==============================================================================
+    void reset() noexcept
+    {
+        for (auto& f : lowCutFilters)
+            f.reset();      // [5]
+        for (auto& f : highCutFilters)
+            f.reset();      // [5]
+
+        for (auto& tap : taps)
+            tap.filterState = Type (0);
+
+        for (auto& diffuser : diffusers)
+            diffuser.reset();
+
+        for (auto& shifter : pitchShifters)
+            shifter.reset();
+
+        duckFollower.reset();
+        feedbackPower = Type (0);
+ 
+        dline.clear();      // [6]
+    }
+
+    //==============================================================================
+    size_t getNumChannels() const noexcept
+    {
+        return maxNumChannels;
+    }
+
+    //==============================================================================
+    /** Sets the longest delay time the line must hold. Takes effect on the next allocate(). */
+    void setMaxDelayTime (Type newValue)
+    {
+        jassert (newValue > Type (0));
+        maxDelayTime = newValue;
+    }
+
+    //==============================================================================
+    /** Number of frames the line needs for the current sample rate and maximum delay time. */
+    size_t getRequiredDelayLineSize() const noexcept
+    {
+        return (size_t) std::ceil (maxDelayTime * sampleRate) + 1;
+    }
+
+    bool isAllocated() const noexcept
+    {
+        return dline.size() > 0;
+    }
+
+    /** Moves a correctly sized line in from the pool. Call this off the audio thread. */
+    void allocate (DelayMemoryPool<Type>& pool)
+    {
+        auto requiredSize = getRequiredDelayLineSize();
+
+        if (dline.size() == requiredSize)
+            return;
+
+        auto storage = pool.acquire (requiredSize * maxNumChannels);
+
+        {
+            const juce::SpinLock::ScopedLockType sl (storageLock);
+            storage = dline.exchangeStorage (std::move (storage));
+        }
+
+        pool.release (std::move (storage));
+    }
+
+    /** Hands the line's memory back to the pool. Call this off the audio thread. */
+    void release (DelayMemoryPool<Type>& pool)
+    {
+        std::vector<Type> storage;
+
+        {
+            const juce::SpinLock::ScopedLockType sl (storageLock);
+            storage = dline.exchangeStorage (std::move (storage));
+        }
+
+        pool.release (std::move (storage));
+    }
+    
+    //==============================================================================
+    void setLowCutFreq (Type newValue) noexcept
     {
         jassert (newValue >= Type (20) && newValue <= Type (20000));
         lowCutFreq = newValue;
@@ -240,10 +2422,21 @@ public:
     }
 
     //==============================================================================
+    /** Above 1 the repeats grow until the feedback compressor, which only engages there,
+        holds them at its threshold.
+    */
     void setFeedback (Type newValue) noexcept
     {
-        jassert (newValue >= Type (0) && newValue <= Type (1));
+        jassert (newValue >= Type (0) && newValue <= maxFeedback);
         feedback = newValue;
+        updateMatrices();
+    }
+
+    /** The RMS level the feedback compressor holds the repeats to, with a soft knee around it. */
+    void setFeedbackThreshold (Type newValueInDecibels) noexcept
+    {
+        feedbackThreshold = newValueInDecibels;
+        feedbackKneeStart = std::pow (Type (10), Type (0.1) * (feedbackThreshold - Type (0.5) * feedbackKnee));
     }
 
     //==============================================================================
@@ -290,80 +2483,605 @@ public:
     }
 
     //==============================================================================
+    /** Amount of diffusion in the feedback path, 0 to 1, and how long the diffuser rings. */
+    void setDiffusion (Type amount, Type decay) noexcept
+    {
+        for (auto& diffuser : diffusers)
+        {
+            diffuser.setAmount (amount);
+            diffuser.setDecay (decay);
+        }
+    }
+
+    //==============================================================================
+    /** Shifts the pitch of what's fed back, so each repeat climbs or falls further than the
+        last (the shimmer). 0 turns the shifter off.
+    */
+    void setPitchShift (Type semitones) noexcept
+    {
+        for (auto& shifter : pitchShifters)
+            shifter.setSemitones (semitones);
+    }
+
+    //==============================================================================
+    /** Number of extra taps mixed into the output, 0 for the plain delay. */
+    void setNumTaps (size_t newValue) noexcept
+    {
+        jassert (newValue <= maxNumTaps);
+        numTaps = juce::jmin (newValue, maxNumTaps);
+        updateTaps();
+    }
+
+    /** Sets up an extra output tap: it reads the line (the mix of all channels) at its own
+        time, through its own one-pole high cut, and is panned into the output. The taps
+        don't feed back, so one delay can play a rhythmic pattern of repeats.
+    */
+    void setTap (size_t index, Type timeInSeconds, Type level, Type pan, Type highCutFrequency) noexcept
+    {
+        if (index >= maxNumTaps)
+        {
+            jassertfalse;
+            return;
+        }
+
+        jassert (timeInSeconds >= Type (0) && level >= Type (0) && pan >= Type (-1) && pan <= Type (1));
+
+        auto& tap = taps[index];
+        tap.time = timeInSeconds;
+        tap.level = level;
+        tap.pan = pan;
+        tap.highCutFrequency = highCutFrequency;
+
+        updateTaps();
+    }
+
+    //==============================================================================
+    /** Selects how the input and the feedback paths are routed between channels. */
+    void setRouting (DelayRouting newValue) noexcept
+    {
+        routing = newValue;
+        updateMatrices();
+    }
+
+    /** Amount of each channel's repeats fed into the other channels in cross-feed mode. */
+    void setCrossFeed (Type newValue) noexcept
+    {
+        jassert (newValue >= Type (0) && newValue <= Type (1));
+        crossFeed = newValue;
+        updateMatrices();
+    }
+
+    /** Stereo width of the wet signal: 0 is mono, 1 unchanged, 2 doubles the side signal. */
+    void setWidth (Type newValue) noexcept
+    {
+        jassert (newValue >= Type (0) && newValue <= Type (2));
+        width = newValue;
+    }
+
+    /** Ducks the wet signal while the input is above thresholdInDecibels, by as much as the
+        input is over it but no more than depthInDecibels. A depth of 0 dB turns it off.
+    */
+    void setDucking (Type thresholdInDecibels, Type depthInDecibels, Type releaseInMilliseconds) noexcept
+    {
+        jassert (depthInDecibels >= Type (0));
+
+        duckThreshold = juce::Decibels::decibelsToGain (thresholdInDecibels);
+        duckFloor = juce::Decibels::decibelsToGain (-depthInDecibels);
+
+        if (releaseInMilliseconds != duckReleaseTime)
+        {
+            duckReleaseTime = releaseInMilliseconds;
+            duckFollower.setReleaseTime (duckReleaseTime);
+        }
+    }
+
+    //==============================================================================
+    /** Switches between forward, frozen and reversed playback. Frozen and reversed playback
+        read the same line, and ignore the delay time modulation.
+    */
+    void setPlayback (DelayPlayback newValue) noexcept
+    {
+        if (playback == newValue)
+            return;
+
+        playback = newValue;
+        playbackPhases.fill (0);
+    }
+
+    /** Optional table to evaluate the feedback saturation (tanh) from instead of
+        calling std::tanh per sample. The table must outlive its use here.
+    */
+    void setSaturationTable (const juce::dsp::LookupTableTransform<Type>* newTable) noexcept
+    {
+        saturationTable.store (newTable, std::memory_order_release);
+    }
+
+    //==============================================================================
+    /** Processes a block. delayTimeOctaves, if given, scales every channel's delay time
+        by 2^delayTimeOctaves[i] at each sample, read from the line with interpolation.
+        If the caller knows the input is silent the line only takes its feedback.
+    */
     template <typename ProcessContext>
-    void process (const ProcessContext& context) noexcept
+    void process (const ProcessContext& context, const float* delayTimeOctaves = nullptr, bool inputIsSilent = false) noexcept
     {
         auto& inputBlock  = context.getInputBlock();
         auto& outputBlock = context.getOutputBlock();
         auto numSamples  = outputBlock.getNumSamples();
-        auto numChannels = outputBlock.getNumChannels();
+        auto numChannels = juce::jmin (outputBlock.getNumChannels(), maxNumChannels);
      
         jassert (inputBlock.getNumSamples() == numSamples);
-        jassert (inputBlock.getNumChannels() == numChannels);
-     
+        jassert (inputBlock.getNumChannels() == outputBlock.getNumChannels());
+
+        const juce::SpinLock::ScopedTryLockType storageTryLock (storageLock);
+
+        if (! storageTryLock.isLocked() || ! isAllocated())
+        {
+            // the line is being swapped: only the repeats drop out, the dry signal keeps its level
+            if (context.usesSeparateInputAndOutputBlocks())
+                outputBlock.replaceWithProductOf (inputBlock, dryLevel);
+            else
+                outputBlock.multiplyBy (dryLevel);
+
+            return;
+        }
+
+        std::array<size_t, maxNumChannels> readOffsets {};
+
+        for (size_t ch = 0; ch < numChannels; ++ch)
+            readOffsets[ch] = juce::jmin (delayTimesSample[ch], dline.size() - 1);
+
+        auto maxModulatedOffset = (Type) dline.size() - Type (1.001);
+
+        updateFeedbackFilterCoefficients();
+
+        std::array<const Type*, maxNumChannels> inputs {};
+        std::array<Type*, maxNumChannels> outputs {};
+
         for (size_t ch = 0; ch < numChannels; ++ch)
         {
-            auto* input  = inputBlock .getChannelPointer (ch);
-            auto* output = outputBlock.getChannelPointer (ch);
-            auto& dline = delayLines[ch];
-            auto delayTime = delayTimesSample[ch];
-            auto& lowCutFilter = lowCutFilters[ch];
-            auto& highCutFilter = highCutFilters[ch];
-            auto& distortion = distortions[ch];
-            
-            distortion.setPreGain(distortionPreGainAmount);
-            distortion.setPostGain(distortionPostGainAmount);
-            
-            lowCutCoefficients = juce::dsp::IIR::Coefficients<Type>::makeFirstOrderHighPass (sampleRate, lowCutFreq);
-            highCutCoefficients = juce::dsp::IIR::Coefficients<Type>::makeFirstOrderLowPass (sampleRate, highCutFreq);
-            lowCutFilter.coefficients = lowCutCoefficients;
-            highCutFilter.coefficients = highCutCoefficients;
-     
-            for (size_t i = 0; i < numSamples; ++i)
+            inputs[ch]  = inputBlock .getChannelPointer (ch);
+            outputs[ch] = outputBlock.getChannelPointer (ch);
+
+            distortions[ch].setPreGain (distortionPreGainAmount);
+            distortions[ch].setPostGain (distortionPostGainAmount);
+        }
+
+        std::array<Type, maxNumChannels> inputFrame {}, delayedFrame {}, dlineFrame {};
+        auto* table = saturationTable.load (std::memory_order_acquire);
+        auto diffuse = diffusers[0].isActive();
+        auto shift = pitchShifters[0].isActive();
+
+        auto currentPlayback = playbackBlockSize > 0 ? playback : Playback_Forward;
+        size_t playbackIndex = playbackBlockSize;
+
+        auto duck = duckFloor < Type (1) && ! duckGains.empty();
+        size_t duckIndex = duckGains.size();
+
+        for (size_t i = 0; i < numSamples; ++i)
+        {
+            auto timeScale = delayTimeOctaves != nullptr ? std::exp2 ((Type) delayTimeOctaves[i]) : Type (1);
+
+            // frozen and reversed playback gather a block at a time from the line
+            if (currentPlayback != Playback_Forward && playbackIndex == playbackBlockSize)
             {
-                auto delayedSample = lowCutFilter.processSample (dline.get (delayTime));
-                delayedSample = highCutFilter.processSample (delayedSample);
-                auto inputSample = input[i];
-                auto dlineInputSample = std::tanh (inputSample + feedback * delayedSample);
-                dline.push (dlineInputSample);
-                
-                auto drySample = inputSample * dryLevel;
-                auto wetSample = wetLevel * delayedSample;
-                auto distortedWetSample = distortion.processSample(wetSample);
-                auto outputSample = drySample + distortedWetSample;
-                output[i] = outputSample;
+                renderPlayback (readOffsets, numChannels, juce::jmin (playbackBlockSize, numSamples - i));
+                playbackIndex = 0;
+            }
+
+            if (duck && duckIndex == duckGains.size())
+            {
+                auto numDuckSamples = juce::jmin (duckGains.size(), numSamples - i);
+                updateDuckGains (inputBlock.getSubsetChannelBlock (0, numChannels).getSubBlock (i, numDuckSamples));
+                duckIndex = 0;
+            }
+
+            for (size_t ch = 0; ch < numChannels; ++ch)
+            {
+                inputFrame[ch] = inputIsSilent ? Type (0) : inputs[ch][i];
+
+                auto lineSample = currentPlayback != Playback_Forward ? playbackBuffer[ch * playbackBlockSize + playbackIndex]
+                                : delayTimeOctaves != nullptr
+                                ? dline.getInterpolated (juce::jmin ((Type) readOffsets[ch] * timeScale, maxModulatedOffset), ch)
+                                : dline.get (readOffsets[ch], ch);
+
+                auto delayedSample = lowCutFilters[ch].processSample (lineSample);
+                delayedSample = highCutFilters[ch].processSample (delayedSample);
+                delayedFrame[ch] = diffuse ? diffusers[ch].processSample (delayedSample) : delayedSample;
+            }
+
+            ++playbackIndex;
+
+            // only the feedback is shifted, between the filters and the saturation, so the first repeat keeps its pitch
+            auto feedbackFrame = delayedFrame;
+
+            if (shift && currentPlayback != Playback_Freeze)
+                for (size_t ch = 0; ch < numChannels; ++ch)
+                    feedbackFrame[ch] = pitchShifters[ch].processSample (delayedFrame[ch]);
+
+            if (currentPlayback != Playback_Freeze)
+            {
+                auto feedbackGain = getFeedbackGain (feedbackFrame, numChannels);
+
+                for (size_t ch = 0; ch < numChannels; ++ch)
+                    feedbackFrame[ch] *= feedbackGain;
+            }
+
+            // a frozen line is neither written nor fed back, so the loop repeats exactly
+            for (size_t ch = 0; ch < numChannels && currentPlayback != Playback_Freeze; ++ch)
+            {
+                auto dlineInputSample = Type (0);
+
+                if (inputIsSilent)
+                {
+                    for (size_t k = 0; k < numChannels; ++k)
+                        dlineInputSample += feedbackMatrix[ch][k] * feedbackFrame[k];
+                }
+                else
+                {
+                    for (size_t k = 0; k < numChannels; ++k)
+                        dlineInputSample += inputMatrix[ch][k] * inputFrame[k] + feedbackMatrix[ch][k] * feedbackFrame[k];
+                }
+
+                dlineFrame[ch] = table != nullptr ? table->processSample (dlineInputSample)
+                                                  : std::tanh (dlineInputSample);
+            }
+
+            if (currentPlayback != Playback_Freeze)
+                dline.pushFrame (dlineFrame.data());
+
+            if (numChannels == 2)
+            {
+                auto mid  = Type (0.5) * (delayedFrame[0] + delayedFrame[1]);
+                auto side = Type (0.5) * (delayedFrame[0] - delayedFrame[1]) * width;
+                delayedFrame[0] = mid + side;
+                delayedFrame[1] = mid - side;
+            }
+
+            // the ducking comes after the wet distortion, so it turns the repeats down rather than cleaning them up
+            auto duckGain = duck ? duckGains[duckIndex++] : Type (1);
+
+            for (size_t ch = 0; ch < numChannels; ++ch)
+            {
+                auto drySample = inputFrame[ch] * dryLevel;
+                auto wetSample = wetLevel * delayedFrame[ch];
+                auto distortedWetSample = distortions[ch].processSample (wetSample);
+                outputs[ch][i] = drySample + duckGain * distortedWetSample;
+            }
+        }
+
+        // checked once a block: anything in the loop that isn't finite ends up in its level
+        if (! std::isfinite (feedbackPower))
+        {
+            reset();
+            outputBlock.clear();
+            return;
+        }
+
+        if (feedbackPower < Type (1.0e-15))
+            feedbackPower = Type (0);
+
+        // the taps would only repeat the same block from a frozen line
+        if (numTaps > 0 && currentPlayback != Playback_Freeze)
+            mixTaps (outputs, numChannels, numSamples, duck);
+    }
+
+    //==============================================================================
+    /** Cheap stand-in for process() while the delay is bypassed: routes the input into
+        the line without reading, filtering or saturating anything and leaves the block
+        untouched, so the line is already full of recent input when the delay comes back.
+    */
+    void keepWarm (const juce::dsp::AudioBlock<Type>& block) noexcept
+    {
+        auto numSamples  = block.getNumSamples();
+        auto numChannels = juce::jmin (block.getNumChannels(), maxNumChannels);
+
+        const juce::SpinLock::ScopedTryLockType storageTryLock (storageLock);
+
+        if (! storageTryLock.isLocked() || ! isAllocated())
+            return;
+
+        std::array<const Type*, maxNumChannels> inputs {};
+
+        for (size_t ch = 0; ch < numChannels; ++ch)
+            inputs[ch] = block.getChannelPointer (ch);
+
+        std::array<Type, maxNumChannels> dlineFrame {};
+
+        for (size_t i = 0; i < numSamples; ++i)
+        {
+            for (size_t ch = 0; ch < numChannels; ++ch)
+            {
+                dlineFrame[ch] = Type (0);
+
+                for (size_t k = 0; k < numChannels; ++k)
+                    dlineFrame[ch] += inputMatrix[ch][k] * inputs[k][i];
             }
+
+            dline.pushFrame (dlineFrame.data());
         }
     }
 
 private:
     //==============================================================================
-    std::array<DelayLine<Type>, maxNumChannels> delayLines;
+    using Matrix = std::array<std::array<Type, maxNumChannels>, maxNumChannels>;
+
+    DelayLine<Type, maxNumChannels> dline;
+    juce::SpinLock storageLock;
     std::array<size_t, maxNumChannels> delayTimesSample;
     std::array<Type, maxNumChannels> delayTimes;
     Type lowCutFreq { Type (500) };
     Type highCutFreq { Type (3000) };
+    Type designedLowCutFreq { Type (0) }, designedHighCutFreq { Type (0) };
     Type feedback { Type (0) };
+
+    // hard enough to hold the most feedback there is within a few dB of the threshold
+    static constexpr Type feedbackRatio = Type (20), feedbackKnee = Type (6);
+    static constexpr double feedbackDetectorTime = 20.0;
+
+    Type feedbackThreshold { Type (-12) }, feedbackKneeStart { Type (0.0316) };
+    Type feedbackEnvelopeCoefficient { Type (0) }, feedbackPower { Type (0) };
     Type dryLevel { Type (0) };
     Type wetLevel { Type (0) };
     Type distortionPreGainAmount { Type (0) };
     Type distortionPostGainAmount { Type (0) };
 
+    std::atomic<const juce::dsp::LookupTableTransform<Type>*> saturationTable { nullptr };
+
+    DelayRouting routing { Routing_Stereo };
+    Type crossFeed { Type (0) };
+    Type width { Type (1) };
+    Matrix inputMatrix {}, feedbackMatrix {};
+
     std::array<juce::dsp::IIR::Filter<Type>, maxNumChannels> lowCutFilters, highCutFilters;
     typename juce::dsp::IIR::Coefficients<Type>::Ptr lowCutCoefficients, highCutCoefficients;
     
-    std::array<Distortion<float>, maxNumChannels> distortions;
+    std::array<Distortion<Type>, maxNumChannels> distortions;
+    std::array<FeedbackDiffuser<Type>, maxNumChannels> diffusers;
+    std::array<PitchShifter<Type>, maxNumChannels> pitchShifters;
+
+    struct Tap
+    {
+        Type time { Type (0) }, level { Type (0) }, pan { Type (0) }, highCutFrequency { Type (20000) };
+
+        size_t delayInSamples { 0 };
+        Type filterCoefficient { Type (1) }, filterState { Type (0) };
+        std::array<Type, maxNumChannels> panGains {};
+    };
+
+    std::array<Tap, maxNumTaps> taps;
+    std::array<size_t, maxNumTaps> tapOrder {};     // the active taps, shortest first
+    size_t numTaps { 0 };
+    std::vector<Type> tapBuffer;
+
+    DelayPlayback playback { Playback_Forward };
+    std::vector<Type> playbackBuffer;
+    size_t playbackBlockSize { 0 };
+    std::array<size_t, maxNumChannels> playbackPhases {};
+
+    EnvelopeFollower<Type> duckFollower;
+    std::vector<Type> duckGains;
+    Type duckThreshold { Type (0.03) }, duckFloor { Type (1) }, duckReleaseTime { Type (250) };
 
     Type sampleRate   { Type (44.1e3) };
     Type maxDelayTime { Type (3) };
 
     //==============================================================================
-    void updateDelayLineSize()
+    /** The feedback compressor's gain for a frame: a one-pole average of its power,
+        linked across channels, compressed hard above the threshold. It only engages
+        with feedback above 1, so an ordinary delay's repeats are left alone; the
+        average keeps running regardless, as the block's check for a broken loop reads it.
+    */
+    Type getFeedbackGain (const std::array<Type, maxNumChannels>& frame, size_t numChannels) noexcept
     {
-        auto delayLineSizeSamples = (size_t) std::ceil (maxDelayTime * sampleRate);
- 
-        for (auto& dline : delayLines)
-            dline.resize (delayLineSizeSamples);    // [2]
+        auto power = Type (0);
+
+        for (size_t ch = 0; ch < numChannels; ++ch)
+            power += frame[ch] * frame[ch];
+
+        feedbackPower += feedbackEnvelopeCoefficient * (power / (Type) numChannels - feedbackPower);
+
+        if (feedback <= Type (1) || feedbackPower <= feedbackKneeStart)
+            return Type (1);
+
+        auto over = Type (10) * std::log10 (feedbackPower) - feedbackThreshold;
+        auto halfKnee = Type (0.5) * feedbackKnee;
+
+        auto compressedOver = over < halfKnee ? juce::square (over + halfKnee) / (Type (2) * feedbackKnee) : over;
+        return juce::Decibels::decibelsToGain (compressedOver * (Type (1) / feedbackRatio - Type (1)));
+    }
+
+    /** Writes the first-order feedback filter coefficients in place into the objects
+        shared by all channels' filters, so changing them never allocates.
+    */
+    void updateFeedbackFilterCoefficients() noexcept
+    {
+        if (lowCutFreq == designedLowCutFreq && highCutFreq == designedHighCutFreq)
+            return;
+
+        // same designs as IIR::Coefficients::makeFirstOrderHighPass / makeFirstOrderLowPass
+        auto lowN = std::tan (juce::MathConstants<Type>::pi * lowCutFreq / sampleRate);
+        auto* lowCut = lowCutCoefficients->getRawCoefficients();
+        lowCut[0] = Type (1) / (lowN + Type (1));
+        lowCut[1] = -lowCut[0];
+        lowCut[2] = (lowN - Type (1)) / (lowN + Type (1));
+
+        auto highN = std::tan (juce::MathConstants<Type>::pi * highCutFreq / sampleRate);
+        auto* highCut = highCutCoefficients->getRawCoefficients();
+        highCut[0] = highN / (highN + Type (1));
+        highCut[1] = highCut[0];
+        highCut[2] = (highN - Type (1)) / (highN + Type (1));
+
+        designedLowCutFreq = lowCutFreq;
+        designedHighCutFreq = highCutFreq;
+    }
+
+    //==============================================================================
+    /** Gathers the next numSamples of frozen or reversed playback for each channel into
+        playbackBuffer, before the samples are written that the block will push.
+
+        A frozen channel loops its last delay time of the line, oldest first; nothing is
+        written while frozen, so it reads runs of the line as they stand.
+
+        A reversed channel plays segments of its delay time backwards, with two heads half
+        a segment apart under triangular windows that sum to one. Sample i of a segment
+        reads 2i + playbackBlockSize samples back, which is a forward run through memory,
+        and the offset keeps every read older than what the block will write, so each head
+        is gathered as one run per segment from the line as it stands before the block.
+    */
+    void renderPlayback (const std::array<size_t, maxNumChannels>& readOffsets, size_t numChannels, size_t numSamples) noexcept
+    {
+        jassert (numSamples <= playbackBlockSize);
+
+        for (size_t ch = 0; ch < numChannels; ++ch)
+        {
+            auto* output = playbackBuffer.data() + ch * playbackBlockSize;
+            auto& phase = playbackPhases[ch];
+
+            if (playback == Playback_Freeze)
+            {
+                auto length = readOffsets[ch] + 1;
+                phase %= length;
+
+                for (size_t start = 0; start < numSamples;)
+                {
+                    auto run = juce::jmin (numSamples - start, length - phase);
+                    dline.copySequence (length - 1 - phase, run, output + start, ch);
+
+                    start += run;
+                    phase = (phase + run) % length;
+                }
+            }
+            else
+            {
+                // the furthest read must stay clear of the block about to be written
+                auto maxSegmentLength = dline.size() > 2 * playbackBlockSize + 2 * minSegmentLength
+                                      ? (dline.size() - 2 * playbackBlockSize) / 2
+                                      : minSegmentLength;
+
+                auto length = juce::jlimit (minSegmentLength, maxSegmentLength, readOffsets[ch] + 1);
+                phase %= length;
+
+                auto* secondHead = playbackBuffer.data() + maxNumChannels * playbackBlockSize;
+
+                renderReversedHead (output, phase, length, numSamples, ch);
+                renderReversedHead (secondHead, (phase + length / 2) % length, length, numSamples, ch);
+                juce::FloatVectorOperations::add (output, secondHead, (int) numSamples);
+
+                phase = (phase + numSamples) % length;
+            }
+        }
+    }
+
+    void renderReversedHead (Type* output, size_t phase, size_t length, size_t numSamples, size_t channel) noexcept
+    {
+        for (size_t start = 0; start < numSamples;)
+        {
+            auto run = juce::jmin (numSamples - start, length - phase);
+
+            dline.copyReversedSequence (playbackBlockSize + 2 * phase - start, run, output + start, channel);
+
+            for (size_t i = 0; i < run; ++i)
+                output[start + i] *= Type (1) - std::abs (Type (2) * (Type) (phase + i) / (Type) length - Type (1));
+
+            start += run;
+            phase = 0;
+        }
+    }
+
+    static constexpr size_t minSegmentLength = 64;
+
+    //==============================================================================
+    /** Follows the input and turns its envelope into wet gains for the block, in place in
+        duckGains: the follower's detector is vector operations over the block, and the gain
+        curve is a branch-free loop over it.
+    */
+    void updateDuckGains (const juce::dsp::AudioBlock<const Type>& input) noexcept
+    {
+        auto numSamples = input.getNumSamples();
+        auto* gains = duckGains.data();
+
+        duckFollower.process (input, gains);
+
+        auto threshold = duckThreshold;
+        auto floor = duckFloor;
+
+        for (size_t i = 0; i < numSamples; ++i)
+            gains[i] = juce::jmax (floor, threshold / juce::jmax (gains[i], threshold));
+    }
+
+    //==============================================================================
+    /** Adds the extra taps to the block just processed. Each tap gathers the whole block
+        from the line as one sequential run, shortest tap first so consecutive taps walk
+        neighbouring memory, and is then filtered and mixed in with vector operations.
+    */
+    void mixTaps (const std::array<Type*, maxNumChannels>& outputs, size_t numChannels, size_t numSamples, bool duck) noexcept
+    {
+        jassert (numSamples <= tapBuffer.size());
+
+        if (numSamples > tapBuffer.size() || dline.size() <= numSamples)
+            return;
+
+        auto* tapSamples = tapBuffer.data();
+        auto channelScale = Type (1) / (Type) numChannels;
+
+        for (size_t t = 0; t < numTaps; ++t)
+        {
+            auto& tap = taps[tapOrder[t]];
+
+            if (tap.level == Type (0))
+                continue;
+
+            // the block has already been pushed, so sample i's frame is numSamples - i further back
+            auto delayInSamples = juce::jmin (tap.delayInSamples, dline.size() - 1 - numSamples) + numSamples;
+
+            std::fill (tapSamples, tapSamples + numSamples, Type (0));
+
+            for (size_t ch = 0; ch < numChannels; ++ch)
+                dline.addSequence (delayInSamples, numSamples, tapSamples, ch);
+
+            auto state = tap.filterState;
+
+            for (size_t i = 0; i < numSamples; ++i)
+            {
+                state += tap.filterCoefficient * (tapSamples[i] * channelScale - state);
+                tapSamples[i] = state;
+            }
+
+            tap.filterState = state;
+
+            // a block that fits the tap buffer fits the duck gains too, so they cover all of it
+            if (duck)
+                juce::FloatVectorOperations::multiply (tapSamples, duckGains.data(), (int) numSamples);
+
+            for (size_t ch = 0; ch < numChannels; ++ch)
+                juce::FloatVectorOperations::addWithMultiply (outputs[ch], tapSamples,
+                                                              wetLevel * tap.level * (numChannels == 2 ? tap.panGains[ch] : Type (1)),
+                                                              (int) numSamples);
+        }
+    }
+
+    void updateTaps() noexcept
+    {
+        for (auto& tap : taps)
+        {
+            tap.delayInSamples = (size_t) juce::roundToInt (tap.time * sampleRate);
+            tap.filterCoefficient = Type (1) - std::exp (-juce::MathConstants<Type>::twoPi
+                                                         * juce::jmin (tap.highCutFrequency, Type (0.49) * sampleRate) / sampleRate);
+
+            // constant power
+            auto angle = (tap.pan + Type (1)) * juce::MathConstants<Type>::pi / Type (4);
+            tap.panGains.fill (Type (1));
+            tap.panGains[0] = std::cos (angle);
+
+            if (maxNumChannels > 1)
+                tap.panGains[1] = std::sin (angle);
+        }
+
+        for (size_t t = 0; t < maxNumTaps; ++t)
+            tapOrder[t] = t;
+
+        std::sort (tapOrder.begin(), tapOrder.begin() + (std::ptrdiff_t) numTaps,
+                   [this] (size_t a, size_t b) { return taps[a].delayInSamples < taps[b].delayInSamples; });
     }
 
     //==============================================================================
@@ -372,4 +3090,56 @@ private:
         for (size_t ch = 0; ch < maxNumChannels; ++ch)
             delayTimesSample[ch] = (size_t) juce::roundToInt (delayTimes[ch] * sampleRate);
     }
+
+    //==============================================================================
+    /** Rebuilds the input and feedback routing matrices, indexed [destination][source]. */
+    void updateMatrices() noexcept
+    {
+        for (auto& row : inputMatrix)
+            row.fill (Type (0));
+
+        for (auto& row : feedbackMatrix)
+            row.fill (Type (0));
+
+        const auto numChannels = maxNumChannels;
+
+        switch (numChannels > 1 ? routing : Routing_Stereo)
+        {
+            case Routing_PingPong:
+            {
+                // the summed input enters the first channel and every repeat moves one channel on
+                for (size_t k = 0; k < numChannels; ++k)
+                    inputMatrix[0][k] = Type (1) / (Type) numChannels;
+
+                for (size_t ch = 0; ch < numChannels; ++ch)
+                    feedbackMatrix[(ch + 1) % numChannels][ch] = feedback;
+
+                break;
+            }
+            case Routing_CrossFeed:
+            {
+                for (size_t ch = 0; ch < numChannels; ++ch)
+                {
+                    inputMatrix[ch][ch] = Type (1);
+
+                    for (size_t k = 0; k < numChannels; ++k)
+                        feedbackMatrix[ch][k] = feedback * (ch == k ? Type (1) - crossFeed
+                                                                    : crossFeed / (Type) (numChannels - 1));
+                }
+
+                break;
+            }
+            case Routing_Stereo:
+            default:
+            {
+                for (size_t ch = 0; ch < numChannels; ++ch)
+                {
+                    inputMatrix[ch][ch] = Type (1);
+                    feedbackMatrix[ch][ch] = feedback;
+                }
+
+                break;
+            }
+        }
+    }
 };
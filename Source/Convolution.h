@@ -0,0 +1,1076 @@
+//
+//  Convolution.h
+//  FilterPedal
+//
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/** Passes objects built off the audio thread over to it, and takes them back to
+    be freed off it again, so the audio thread never allocates or frees them.
+    Holds at most one object each way; posting nullptr is a request too.
+*/
+template <typename ObjectType>
+class RealtimeHandover
+{
+public:
+    //==============================================================================
+    /** Non-realtime: queues object for the audio thread. An object queued before that
+        wasn't collected yet is replaced, and one handed back is freed, both here.
+    */
+    void post (std::unique_ptr<ObjectType> object)
+    {
+        std::unique_ptr<ObjectType> returned;
+
+        {
+            const juce::SpinLock::ScopedLockType sl (lock);
+            std::swap (pending, object);
+            returned = std::move (handedBack);
+            isPending = true;
+        }
+    }
+
+    /** Non-realtime: drops the queued request and frees everything held. */
+    void clear()
+    {
+        std::unique_ptr<ObjectType> queued, returned;
+
+        {
+            const juce::SpinLock::ScopedLockType sl (lock);
+            queued = std::move (pending);
+            returned = std::move (handedBack);
+            isPending = false;
+        }
+    }
+
+    //==============================================================================
+    /** Realtime: moves the queued object (which may be nullptr) into destination and returns
+        true, or returns false if nothing was posted since the last collect or the lock is busy.
+    */
+    bool collect (std::unique_ptr<ObjectType>& destination) noexcept
+    {
+        const juce::SpinLock::ScopedTryLockType sl (lock);
+
+        if (! sl.isLocked() || ! isPending)
+            return false;
+
+        destination = std::move (pending);
+        isPending = false;
+        return true;
+    }
+
+    /** Realtime: hands object back to be freed by the next post(). If the way back is
+        still taken, or the lock is busy, object is left alone and false returned.
+    */
+    bool giveBack (std::unique_ptr<ObjectType>& object) noexcept
+    {
+        const juce::SpinLock::ScopedTryLockType sl (lock);
+
+        if (! sl.isLocked() || handedBack != nullptr)
+            return false;
+
+        handedBack = std::move (object);
+        return true;
+    }
+
+private:
+    juce::SpinLock lock;
+    std::unique_ptr<ObjectType> pending, handedBack;
+    bool isPending { false };
+};
+
+//==============================================================================
+/** An FIR kernel cut into equal partitions, each kept as the spectrum of the
+    partition zero padded to twice its length: the form PartitionedConvolver
+    multiplies with. Built off the audio thread and never changed afterwards.
+*/
+struct ConvolutionKernel
+{
+    using Spectrum = std::vector<std::complex<float>>;
+
+    size_t partitionSize { 0 };
+    std::vector<Spectrum> partitions;   // partitionSize + 1 bins each
+
+    /** Cuts length samples of impulse into partitions of partitionSize (a power of two) and transforms them. */
+    static std::unique_ptr<ConvolutionKernel> fromImpulseResponse (const float* impulse, size_t length, size_t partitionSize)
+    {
+        jassert (juce::isPowerOfTwo (partitionSize));
+
+        auto kernel = std::make_unique<ConvolutionKernel>();
+        kernel->partitionSize = partitionSize;
+
+        juce::dsp::FFT fft (getOrder (2 * partitionSize));
+        std::vector<float> buffer (4 * partitionSize);
+
+        for (size_t start = 0; start < length; start += partitionSize)
+        {
+            std::fill (buffer.begin(), buffer.end(), 0.0f);
+            std::copy (impulse + start, impulse + juce::jmin (length, start + partitionSize), buffer.begin());
+
+            fft.performRealOnlyForwardTransform (buffer.data(), true);
+
+            auto* bins = reinterpret_cast<const std::complex<float>*> (buffer.data());
+            kernel->partitions.emplace_back (bins, bins + partitionSize + 1);
+        }
+
+        return kernel;
+    }
+
+    /** The FFT order for a power of two size. */
+    static int getOrder (size_t size) noexcept
+    {
+        int order = 0;
+
+        while (((size_t) 1 << order) < size)
+            ++order;
+
+        return order;
+    }
+};
+
+//==============================================================================
+/** Uniformly partitioned overlap-save convolution.
+
+    Input is gathered into partitions; each full partition is transformed once
+    and joins a frequency domain delay line, and the output partition is the sum
+    of that line multiplied bin by bin with the kernel's partitions, transformed
+    back. With the number of partitions fixed, the work per sample grows with
+    the log of the kernel length. The latency is one partition.
+
+    New kernels arrive from any non-realtime thread through setKernel(), and the
+    audio thread crossfades to them over a few partitions. Kernels are only ever
+    created and freed off the audio thread.
+*/
+class PartitionedConvolver
+{
+public:
+    //==============================================================================
+    /** Allocates everything for up to numPartitions of partitionSize (a power of two). Drops the kernel. */
+    void prepare (size_t numChannelsToUse, size_t newPartitionSize, size_t newNumPartitions)
+    {
+        jassert (juce::isPowerOfTwo (newPartitionSize) && newNumPartitions > 0);
+
+        partitionSize = newPartitionSize;
+        numPartitions = newNumPartitions;
+        numBins = partitionSize + 1;
+
+        fft = std::make_unique<juce::dsp::FFT> (ConvolutionKernel::getOrder (2 * partitionSize));
+        fftBuffer.assign (4 * partitionSize, 0.0f);
+        accumulator.assign (numBins, {});
+        fadeBuffer.assign (partitionSize, 0.0f);
+
+        channels.resize (numChannelsToUse);
+
+        for (auto& channel : channels)
+        {
+            channel.input.assign (2 * partitionSize, 0.0f);
+            channel.output.assign (partitionSize, 0.0f);
+            channel.spectra.assign (numPartitions * numBins, {});
+        }
+
+        currentKernel.reset();
+        nextKernel.reset();
+        fading = false;
+
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        for (auto& channel : channels)
+        {
+            std::fill (channel.input.begin(), channel.input.end(), 0.0f);
+            std::fill (channel.output.begin(), channel.output.end(), 0.0f);
+            std::fill (channel.spectra.begin(), channel.spectra.end(), std::complex<float>());
+        }
+
+        position = 0;
+        spectraHead = 0;
+    }
+
+    size_t getLatencySamples() const noexcept
+    {
+        return partitionSize;
+    }
+
+    //==============================================================================
+    /** Hands a kernel over to the audio thread, which fades to it from the current one.
+        A kernel made for another partition size is ignored. Call this off the audio thread.
+    */
+    void setKernel (std::unique_ptr<ConvolutionKernel> newKernel)
+    {
+        kernels.post (std::move (newKernel));
+    }
+
+    //==============================================================================
+    template <typename SampleType>
+    void process (const juce::dsp::AudioBlock<SampleType>& block) noexcept
+    {
+        acquirePendingKernel();
+
+        auto numChannels = juce::jmin (block.getNumChannels(), channels.size());
+        auto numSamples  = block.getNumSamples();
+
+        for (size_t start = 0; start < numSamples && partitionSize > 0;)
+        {
+            auto chunkSize = juce::jmin (numSamples - start, partitionSize - position);
+
+            for (size_t ch = 0; ch < numChannels; ++ch)
+            {
+                auto* data = block.getChannelPointer (ch) + start;
+                auto& channel = channels[ch];
+
+                for (size_t i = 0; i < chunkSize; ++i)
+                {
+                    channel.input[partitionSize + position + i] = (float) data[i];
+                    data[i] = (SampleType) channel.output[position + i];
+                }
+            }
+
+            position += chunkSize;
+            start += chunkSize;
+
+            if (position == partitionSize)
+            {
+                processPartition (numChannels);
+                position = 0;
+            }
+        }
+    }
+
+private:
+    //==============================================================================
+    struct Channel
+    {
+        std::vector<float> input;                   // the previous partition, then the one being filled
+        std::vector<float> output;                  // the partition being played
+        std::vector<std::complex<float>> spectra;   // the frequency domain delay line, numPartitions * numBins
+    };
+
+    static constexpr size_t numFadePartitions = 4;
+
+    //==============================================================================
+    void processPartition (size_t numChannels) noexcept
+    {
+        for (size_t ch = 0; ch < numChannels; ++ch)
+        {
+            auto& channel = channels[ch];
+
+            std::copy (channel.input.begin(), channel.input.end(), fftBuffer.begin());
+            std::fill (fftBuffer.begin() + (std::ptrdiff_t) (2 * partitionSize), fftBuffer.end(), 0.0f);
+            fft->performRealOnlyForwardTransform (fftBuffer.data(), true);
+
+            auto* bins = reinterpret_cast<const std::complex<float>*> (fftBuffer.data());
+            std::copy (bins, bins + numBins, channel.spectra.begin() + (std::ptrdiff_t) (spectraHead * numBins));
+
+            // the partition just filled becomes the previous one
+            std::copy (channel.input.begin() + (std::ptrdiff_t) partitionSize, channel.input.end(), channel.input.begin());
+
+            if (currentKernel == nullptr)
+            {
+                std::fill (channel.output.begin(), channel.output.end(), 0.0f);
+                continue;
+            }
+
+            convolve (channel, *currentKernel, channel.output.data());
+
+            if (fading)
+            {
+                convolve (channel, *nextKernel, fadeBuffer.data());
+
+                auto fadeLength = (float) (numFadePartitions * partitionSize);
+
+                for (size_t i = 0; i < partitionSize; ++i)
+                {
+                    auto amount = (float) (fadePosition + i) / fadeLength;
+                    channel.output[i] += amount * (fadeBuffer[i] - channel.output[i]);
+                }
+            }
+        }
+
+        spectraHead = (spectraHead + 1) % numPartitions;
+
+        if (fading)
+        {
+            fadePosition += partitionSize;
+
+            if (fadePosition >= numFadePartitions * partitionSize)
+            {
+                // the old kernel waits in nextKernel until it can be handed back for freeing
+                std::swap (currentKernel, nextKernel);
+                fading = false;
+            }
+        }
+    }
+
+    void convolve (const Channel& channel, const ConvolutionKernel& kernel, float* output) noexcept
+    {
+        std::fill (accumulator.begin(), accumulator.end(), std::complex<float>());
+
+        auto numKernelPartitions = juce::jmin (kernel.partitions.size(), numPartitions);
+
+        for (size_t p = 0; p < numKernelPartitions; ++p)
+        {
+            auto* x = channel.spectra.data() + ((spectraHead + numPartitions - p) % numPartitions) * numBins;
+            auto* h = kernel.partitions[p].data();
+
+            for (size_t k = 0; k < numBins; ++k)
+                accumulator[k] += x[k] * h[k];
+        }
+
+        std::fill (fftBuffer.begin(), fftBuffer.end(), 0.0f);
+        std::copy (accumulator.begin(), accumulator.end(), reinterpret_cast<std::complex<float>*> (fftBuffer.data()));
+        fft->performRealOnlyInverseTransform (fftBuffer.data());
+
+        // overlap-save: the first half wrapped around, the second half is the new output
+        std::copy (fftBuffer.begin() + (std::ptrdiff_t) partitionSize,
+                   fftBuffer.begin() + (std::ptrdiff_t) (2 * partitionSize),
+                   output);
+    }
+
+    void acquirePendingKernel() noexcept
+    {
+        if (fading)
+            return;
+
+        // the kernel faded out last time goes back to be freed first
+        if (nextKernel != nullptr && ! kernels.giveBack (nextKernel))
+            return;
+
+        std::unique_ptr<ConvolutionKernel> kernel;
+
+        if (! kernels.collect (kernel) || kernel == nullptr)
+            return;
+
+        // made for the partition size before the last prepare(), so it just goes back
+        if (kernel->partitionSize != partitionSize)
+        {
+            nextKernel = std::move (kernel);
+            return;
+        }
+
+        if (currentKernel == nullptr)
+        {
+            currentKernel = std::move (kernel);
+            return;
+        }
+
+        nextKernel = std::move (kernel);
+        fading = true;
+        fadePosition = 0;
+    }
+
+    //==============================================================================
+    size_t partitionSize { 0 }, numPartitions { 0 }, numBins { 0 };
+    size_t position { 0 }, spectraHead { 0 };
+
+    std::unique_ptr<juce::dsp::FFT> fft;
+    std::vector<float> fftBuffer, fadeBuffer;
+    std::vector<std::complex<float>> accumulator;
+    std::vector<Channel> channels;
+
+    RealtimeHandover<ConvolutionKernel> kernels;
+    std::unique_ptr<ConvolutionKernel> currentKernel, nextKernel;
+    bool fading { false };
+    size_t fadePosition { 0 };
+};
+
+//==============================================================================
+/** A zero phase FIR with any magnitude response, run through a PartitionedConvolver.
+
+    Kernels are designed by frequency sampling: the magnitude is sampled at every
+    FFT bin, transformed back with no phase, centred and windowed. The kernel is
+    about 80 ms long whatever the sample rate, so the lowest cutoffs still fit.
+    Its latency is half the kernel plus the convolver's partition.
+
+    Shared with the background jobs that design its kernels, which hold it
+    through a weak_ptr, so it can go away while a design is still queued.
+*/
+class LinearPhaseFilter
+{
+public:
+    //==============================================================================
+    static constexpr size_t numPartitions = 8;
+
+    using MagnitudeFunction = std::function<double (double frequency)>;
+
+    //==============================================================================
+    static size_t getKernelLength (double sampleRate) noexcept
+    {
+        return (size_t) juce::nextPowerOfTwo (juce::roundToInt (sampleRate * 0.08));
+    }
+
+    void prepare (double sampleRate, size_t numChannels)
+    {
+        kernelLength = getKernelLength (sampleRate);
+        convolver.prepare (numChannels, kernelLength / numPartitions, numPartitions);
+    }
+
+    void reset() noexcept
+    {
+        convolver.reset();
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return (int) (kernelLength / 2 + convolver.getLatencySamples());
+    }
+
+    //==============================================================================
+    /** Returns the ticket for the newest design, so older ones still queued can be skipped. */
+    int requestDesign() noexcept
+    {
+        return ++latestDesign;
+    }
+
+    /** Designs the kernel for magnitude at sampleRate and hands it to the audio thread,
+        unless a newer design has been requested since. Call this off the audio thread.
+    */
+    void design (const MagnitudeFunction& magnitude, double sampleRate, int ticket)
+    {
+        if (ticket != latestDesign.load())
+            return;
+
+        auto length = getKernelLength (sampleRate);
+        juce::dsp::FFT fft (ConvolutionKernel::getOrder (length));
+
+        // the zero phase spectrum, which the inverse transform turns into a real, even response
+        std::vector<float> buffer (2 * length, 0.0f);
+        auto* bins = reinterpret_cast<std::complex<float>*> (buffer.data());
+
+        for (size_t k = 0; k <= length / 2; ++k)
+            bins[k] = (float) magnitude ((double) k * sampleRate / (double) length);
+
+        fft.performRealOnlyInverseTransform (buffer.data());
+
+        // centre it, and window it with a Blackman so the truncation doesn't ripple
+        std::vector<float> impulse (length);
+
+        for (size_t n = 0; n < length; ++n)
+        {
+            auto phase = juce::MathConstants<double>::twoPi * (double) n / (double) length;
+            auto window = 0.42 - 0.5 * std::cos (phase) + 0.08 * std::cos (2.0 * phase);
+
+            impulse[n] = buffer[(n + length / 2) % length] * (float) window;
+        }
+
+        convolver.setKernel (ConvolutionKernel::fromImpulseResponse (impulse.data(), length, length / numPartitions));
+    }
+
+    //==============================================================================
+    template <typename SampleType>
+    void process (const juce::dsp::AudioBlock<SampleType>& block) noexcept
+    {
+        convolver.process (block);
+    }
+
+private:
+    //==============================================================================
+    PartitionedConvolver convolver;
+    size_t kernelLength { 0 };
+    std::atomic<int> latestDesign { 0 };
+};
+
+//==============================================================================
+/** The one thread that runs the convolution tails of every instance in the process,
+    shared through SharedDspResources.
+
+    The audio thread never signals it, as that would take a lock: each client only
+    publishes a count of the blocks it has posted, and the worker polls every
+    client a few times per tail partition. With no clients it sleeps until one is
+    added.
+*/
+class ConvolutionTailWorker : private juce::Thread
+{
+public:
+    //==============================================================================
+    struct Client
+    {
+        virtual ~Client() = default;
+
+        /** Worker thread: does whatever work has been posted since the last call. */
+        virtual void runPendingWork() noexcept = 0;
+    };
+
+    //==============================================================================
+    ConvolutionTailWorker()
+        : juce::Thread ("Convolution tails")
+    {
+    }
+
+    ~ConvolutionTailWorker() override
+    {
+        stopThread (1000);
+    }
+
+    //==============================================================================
+    /** Non-realtime: starts polling client, starting the thread the first time. */
+    void add (Client& client)
+    {
+        {
+            const juce::ScopedLock sl (lock);
+            clients.push_back (&client);
+
+            if (! isThreadRunning())
+                startThread (8);
+        }
+
+        notify();
+    }
+
+    /** Non-realtime: stops polling client, waiting for the worker to be done with it. */
+    void remove (Client& client)
+    {
+        const juce::ScopedLock sl (lock);
+        clients.erase (std::remove (clients.begin(), clients.end(), &client), clients.end());
+    }
+
+private:
+    //==============================================================================
+    // well inside the shortest time a tail block has, its latency at 192 kHz
+    static constexpr int pollIntervalMs = 2;
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            auto idle = true;
+
+            {
+                const juce::ScopedLock sl (lock);
+
+                for (auto* client : clients)
+                    client->runPendingWork();
+
+                idle = clients.empty();
+            }
+
+            wait (idle ? -1 : pollIntervalMs);
+        }
+    }
+
+    //==============================================================================
+    juce::CriticalSection lock;
+    std::vector<Client*> clients;
+
+    JUCE_DECLARE_NON_COPYABLE (ConvolutionTailWorker)
+};
+
+//==============================================================================
+/** Zero latency convolution with a long impulse response, such as a speaker cabinet.
+
+    The response is split non-uniformly: its first taps run as a direct FIR, then
+    each segment after that is convolved with partitions four times the length of
+    the one before (see segmentLayout). A segment starting m partitions into the
+    response has m partitions' time to finish each block, so the short, early
+    segments are done on the audio thread as each block completes, and the long
+    tail is done on the shared ConvolutionTailWorker, well ahead of when it's
+    needed. The audio thread's cost is uneven with small host buffers: at 32
+    samples, every other callback runs the 64 sample partitions' transforms and
+    every eighth one the 256 sample partitions' 512 point FFTs as well.
+
+    Everything is allocated by the constructor, on a non-realtime thread; process()
+    only runs on the audio thread. Each channel of the response is convolved with
+    the matching input channel; a mono response is used for every channel.
+*/
+class NonUniformConvolver : private ConvolutionTailWorker::Client
+{
+public:
+    //==============================================================================
+    static constexpr size_t headLength = 64;
+
+    /** Each segment's partition size and where it starts in the response. */
+    struct SegmentLayout
+    {
+        size_t partitionSize, start;
+    };
+
+    static constexpr std::array<SegmentLayout, 3> segmentLayout { { { 64, 64 }, { 256, 1024 }, { 1024, 4096 } } };
+
+    //==============================================================================
+    NonUniformConvolver (const juce::AudioBuffer<float>& impulse, size_t numChannelsToUse, ConvolutionTailWorker& worker)
+        : numChannels (numChannelsToUse)
+    {
+        auto length = (size_t) impulse.getNumSamples();
+        auto numImpulseChannels = (size_t) juce::jmax (1, impulse.getNumChannels());
+
+        // the head taps are stored reversed, so the FIR is a plain dot product
+        headTaps.resize (numImpulseChannels);
+
+        for (size_t i = 0; i < numImpulseChannels; ++i)
+        {
+            headTaps[i].assign (headLength, 0.0f);
+            auto* data = impulse.getReadPointer ((int) juce::jmin (i, (size_t) impulse.getNumChannels() - 1));
+
+            for (size_t k = 0; k < juce::jmin (headLength, length); ++k)
+                headTaps[i][headLength - 1 - k] = data[k];
+        }
+
+        headHistory.resize (numChannels);
+
+        for (auto& history : headHistory)
+            history.assign (headLength - 1 + segmentLayout[0].partitionSize, 0.0f);
+
+        for (size_t k = 0; k < segmentLayout.size(); ++k)
+        {
+            auto start = segmentLayout[k].start;
+            auto end = k + 1 < segmentLayout.size() ? juce::jmin (length, segmentLayout[k + 1].start) : length;
+
+            if (start >= end)
+                break;
+
+            segments.push_back (std::make_unique<Segment> (impulse, start, end, segmentLayout[k].partitionSize,
+                                                           numChannels, k + 1 == segmentLayout.size()));
+        }
+
+        if (! segments.empty() && segments.back()->runsOnWorker)
+        {
+            tailWorker = &worker;
+            tailWorker->add (*this);
+        }
+    }
+
+    ~NonUniformConvolver() override
+    {
+        if (tailWorker != nullptr)
+            tailWorker->remove (*this);
+    }
+
+    //==============================================================================
+    template <typename SampleType>
+    void process (const juce::dsp::AudioBlock<SampleType>& block) noexcept
+    {
+        auto numChannelsToProcess = juce::jmin (block.getNumChannels(), numChannels);
+        auto numSamples = block.getNumSamples();
+
+        for (size_t start = 0; start < numSamples;)
+        {
+            // no chunk crosses the end of any segment's partition
+            auto chunkSize = numSamples - start;
+
+            for (auto& segment : segments)
+                chunkSize = juce::jmin (chunkSize, segment->partitionSize - segment->position);
+
+            chunkSize = juce::jmin (chunkSize, segmentLayout[0].partitionSize);
+
+            for (size_t ch = 0; ch < numChannelsToProcess; ++ch)
+            {
+                auto* data = block.getChannelPointer (ch) + start;
+                auto& history = headHistory[ch];
+                const auto& taps = headTaps[juce::jmin (ch, headTaps.size() - 1)];
+
+                for (size_t i = 0; i < chunkSize; ++i)
+                    history[headLength - 1 + i] = (float) data[i];
+
+                for (auto& segment : segments)
+                    segment->write (ch, history.data() + headLength - 1, chunkSize);
+
+                for (size_t i = 0; i < chunkSize; ++i)
+                {
+                    auto sum = 0.0f;
+
+                    for (size_t k = 0; k < headLength; ++k)
+                        sum += taps[k] * history[i + k];
+
+                    for (auto& segment : segments)
+                        sum += segment->read (ch, i);
+
+                    data[i] = (SampleType) sum;
+                }
+
+                std::copy (history.begin() + (std::ptrdiff_t) chunkSize,
+                           history.begin() + (std::ptrdiff_t) (chunkSize + headLength - 1),
+                           history.begin());
+            }
+
+            for (auto& segment : segments)
+            {
+                segment->position += chunkSize;
+
+                if (segment->position == segment->partitionSize)
+                    segment->completeBlock();
+            }
+
+            start += chunkSize;
+        }
+    }
+
+private:
+    //==============================================================================
+    /** One uniformly partitioned part of the response, [start, end). */
+    struct Segment
+    {
+        Segment (const juce::AudioBuffer<float>& impulse, size_t start, size_t end,
+                 size_t partitionSizeToUse, size_t numChannels, bool shouldRunOnWorker)
+            : partitionSize (partitionSizeToUse),
+              numBins (partitionSizeToUse + 1),
+              latencyBlocks (start / partitionSizeToUse),
+              runsOnWorker (shouldRunOnWorker),
+              fft (ConvolutionKernel::getOrder (2 * partitionSizeToUse))
+        {
+            jassert (start % partitionSize == 0 && latencyBlocks >= 1);
+
+            for (int i = 0; i < juce::jmax (1, impulse.getNumChannels()); ++i)
+                kernels.push_back (ConvolutionKernel::fromImpulseResponse (impulse.getReadPointer (juce::jmin (i, impulse.getNumChannels() - 1)) + start,
+                                                                           end - start, partitionSize));
+
+            numPartitions = kernels.front()->partitions.size();
+            numOutputSlots = latencyBlocks + 1;
+
+            // one more than the worker can be behind by, so the slot the audio thread fills next is never one it reads
+            numInboxSlots = latencyBlocks + 1;
+
+            fftBuffer.assign (4 * partitionSize, 0.0f);
+            accumulator.assign (numBins, {});
+
+            channels.resize (numChannels);
+
+            for (auto& channel : channels)
+            {
+                channel.input.assign (partitionSize, 0.0f);
+                channel.previous.assign (partitionSize, 0.0f);
+                channel.spectra.assign (numPartitions * numBins, {});
+                channel.output.assign (numOutputSlots * partitionSize, 0.0f);
+                channel.inbox.assign (runsOnWorker ? numInboxSlots * partitionSize : 0, 0.0f);
+            }
+        }
+
+        //==============================================================================
+        // audio thread
+
+        void write (size_t ch, const float* data, size_t numSamples) noexcept
+        {
+            std::copy (data, data + numSamples, channels[ch].input.begin() + (std::ptrdiff_t) position);
+        }
+
+        float read (size_t ch, size_t offset) const noexcept
+        {
+            return outputReady ? channels[ch].output[(blockCount % numOutputSlots) * partitionSize + position + offset] : 0.0f;
+        }
+
+        void completeBlock() noexcept
+        {
+            if (runsOnWorker)
+            {
+                auto slot = (blockCount % numInboxSlots) * partitionSize;
+
+                for (auto& channel : channels)
+                    std::copy (channel.input.begin(), channel.input.end(), channel.inbox.begin() + (std::ptrdiff_t) slot);
+
+                postedBlocks.store (blockCount + 1, std::memory_order_release);
+            }
+            else
+            {
+                computeBlock (blockCount);
+            }
+
+            position = 0;
+            ++blockCount;
+
+            // the block starting now was computed from the one latencyBlocks before it; a
+            // worker that fell behind only costs the tail for this block
+            outputReady = ! runsOnWorker
+                       || processedBlocks.load (std::memory_order_acquire) + latencyBlocks > blockCount;
+        }
+
+        //==============================================================================
+        // audio thread for the early segments, the worker for the tail
+
+        void computeBlock (size_t blockIndex) noexcept
+        {
+            auto inboxSlot = (blockIndex % numInboxSlots) * partitionSize;
+            auto outputSlot = ((blockIndex + latencyBlocks) % numOutputSlots) * partitionSize;
+
+            for (size_t ch = 0; ch < channels.size(); ++ch)
+            {
+                auto& channel = channels[ch];
+                const auto& kernel = *kernels[juce::jmin (ch, kernels.size() - 1)];
+                auto* block = runsOnWorker ? channel.inbox.data() + inboxSlot : channel.input.data();
+
+                std::copy (channel.previous.begin(), channel.previous.end(), fftBuffer.begin());
+                std::copy (block, block + partitionSize, fftBuffer.begin() + (std::ptrdiff_t) partitionSize);
+                std::fill (fftBuffer.begin() + (std::ptrdiff_t) (2 * partitionSize), fftBuffer.end(), 0.0f);
+                std::copy (block, block + partitionSize, channel.previous.begin());
+
+                fft.performRealOnlyForwardTransform (fftBuffer.data(), true);
+
+                auto* bins = reinterpret_cast<const std::complex<float>*> (fftBuffer.data());
+                std::copy (bins, bins + numBins, channel.spectra.begin() + (std::ptrdiff_t) (spectraHead * numBins));
+
+                std::fill (accumulator.begin(), accumulator.end(), std::complex<float>());
+
+                for (size_t p = 0; p < numPartitions; ++p)
+                {
+                    auto* x = channel.spectra.data() + ((spectraHead + numPartitions - p) % numPartitions) * numBins;
+                    auto* h = kernel.partitions[p].data();
+
+                    for (size_t k = 0; k < numBins; ++k)
+                        accumulator[k] += x[k] * h[k];
+                }
+
+                std::fill (fftBuffer.begin(), fftBuffer.end(), 0.0f);
+                std::copy (accumulator.begin(), accumulator.end(), reinterpret_cast<std::complex<float>*> (fftBuffer.data()));
+                fft.performRealOnlyInverseTransform (fftBuffer.data());
+
+                std::copy (fftBuffer.begin() + (std::ptrdiff_t) partitionSize,
+                           fftBuffer.begin() + (std::ptrdiff_t) (2 * partitionSize),
+                           channel.output.begin() + (std::ptrdiff_t) outputSlot);
+            }
+
+            spectraHead = (spectraHead + 1) % numPartitions;
+        }
+
+        //==============================================================================
+        struct Channel
+        {
+            std::vector<float> input, previous;         // the block being filled, and the one before it
+            std::vector<float> inbox;                   // completed blocks waiting for the worker
+            std::vector<std::complex<float>> spectra;   // the frequency domain delay line
+            std::vector<float> output;                  // numOutputSlots blocks of output, ahead of time
+        };
+
+        size_t partitionSize, numBins, latencyBlocks, numPartitions { 0 }, numOutputSlots { 0 }, numInboxSlots { 1 };
+        bool runsOnWorker;
+
+        juce::dsp::FFT fft;
+        std::vector<std::unique_ptr<ConvolutionKernel>> kernels;    // one per channel of the response
+        std::vector<float> fftBuffer;
+        std::vector<std::complex<float>> accumulator;
+        std::vector<Channel> channels;
+        size_t spectraHead { 0 };
+
+        size_t position { 0 }, blockCount { 0 };
+        bool outputReady { true };
+        std::atomic<size_t> postedBlocks { 0 }, processedBlocks { 0 };
+    };
+
+    //==============================================================================
+    void runPendingWork() noexcept override
+    {
+        auto& tail = *segments.back();
+
+        for (;;)
+        {
+            auto posted = tail.postedBlocks.load (std::memory_order_acquire);
+            auto processed = tail.processedBlocks.load (std::memory_order_relaxed);
+
+            if (processed >= posted)
+                break;
+
+            // too far behind: the oldest blocks in the inbox have been overwritten already, and
+            // the one before the newest latencyBlocks is the slot being filled right now
+            if (posted - processed > tail.latencyBlocks)
+                processed = posted - tail.latencyBlocks;
+
+            tail.computeBlock (processed);
+            tail.processedBlocks.store (processed + 1, std::memory_order_release);
+        }
+    }
+
+    //==============================================================================
+    size_t numChannels;
+    ConvolutionTailWorker* tailWorker { nullptr };
+    std::vector<std::vector<float>> headTaps;       // per channel of the response, reversed
+    std::vector<std::vector<float>> headHistory;    // per input channel: the last headLength - 1 samples, then the chunk
+    std::vector<std::unique_ptr<Segment>> segments;
+
+    JUCE_DECLARE_NON_COPYABLE (NonUniformConvolver)
+};
+
+//==============================================================================
+/** A chain stage convolving with a loaded impulse response, with no latency.
+
+    Convolvers for new responses are built off the audio thread and handed over
+    with setConvolver(); the stage crossfades to each one over fadeLength samples.
+    With no response loaded, the stage passes its input through.
+
+    Shared with the background jobs that load responses, which hold it through a
+    weak_ptr, like LinearPhaseFilter.
+*/
+class ImpulseResponseStage
+{
+public:
+    //==============================================================================
+    static constexpr int fadeLength = 2048;
+
+    /** Longer responses are cut short; cabinets ring for far less than this. */
+    static constexpr double maxLengthSeconds = 2.0;
+
+    void prepare (int maximumBlockSize, size_t numChannelsToUse)
+    {
+        numChannels = numChannelsToUse;
+        fadeBuffer.setSize ((int) numChannels, maximumBlockSize);
+
+        // a convolver is only good for the sample rate its response was resampled to
+        currentConvolver.reset();
+        nextConvolver.reset();
+        convolvers.clear();
+        fadePosition = -1;
+    }
+
+    size_t getNumChannels() const noexcept
+    {
+        return numChannels;
+    }
+
+    /** Audio thread: true while a response is loaded or being faded, so the output can ring on after the input. */
+    bool isActive() const noexcept
+    {
+        return currentConvolver != nullptr || fadePosition >= 0;
+    }
+
+    //==============================================================================
+    /** Returns the ticket for the newest load, so that older ones finishing late are dropped. */
+    int requestLoad() noexcept
+    {
+        return ++latestLoad;
+    }
+
+    /** Non-realtime: hands over the convolver for a new response, or nullptr to unload it,
+        unless a newer load has been requested since ticket was.
+    */
+    void setConvolver (std::unique_ptr<NonUniformConvolver> newConvolver, int ticket)
+    {
+        if (ticket == latestLoad.load())
+            convolvers.post (std::move (newConvolver));
+    }
+
+    /** Reads a WAV file through a memory map and resamples it to sampleRate, scaled to unit
+        energy so that responses recorded at different levels play alike. Returns an empty
+        buffer if the file can't be read. Not realtime safe.
+    */
+    static juce::AudioBuffer<float> loadImpulseResponse (const juce::File& file, double sampleRate)
+    {
+        juce::WavAudioFormat wav;
+        std::unique_ptr<juce::MemoryMappedAudioFormatReader> reader (wav.createMemoryMappedReader (file));
+
+        if (reader == nullptr || ! reader->mapEntireFile() || reader->lengthInSamples <= 0 || sampleRate <= 0)
+            return {};
+
+        auto numImpulseChannels = (int) juce::jmin (2u, reader->numChannels);
+        auto length = (int) juce::jmin (reader->lengthInSamples, (juce::int64) (maxLengthSeconds * reader->sampleRate));
+
+        // the interpolator reads a few samples past the end
+        juce::AudioBuffer<float> source (numImpulseChannels, length + 8);
+        source.clear();
+        reader->read (&source, 0, length, 0, true, true);
+
+        auto ratio = reader->sampleRate / sampleRate;
+        auto resampledLength = juce::jmax (1, (int) std::ceil (length / ratio));
+
+        juce::AudioBuffer<float> impulse (numImpulseChannels, resampledLength);
+
+        for (int ch = 0; ch < numImpulseChannels; ++ch)
+        {
+            juce::LagrangeInterpolator interpolator;
+            interpolator.process (ratio, source.getReadPointer (ch), impulse.getWritePointer (ch), resampledLength);
+        }
+
+        auto energy = 0.0;
+
+        for (int ch = 0; ch < numImpulseChannels; ++ch)
+        {
+            auto channelEnergy = 0.0;
+
+            for (int i = 0; i < resampledLength; ++i)
+                channelEnergy += juce::square ((double) impulse.getSample (ch, i));
+
+            energy = juce::jmax (energy, channelEnergy);
+        }
+
+        if (energy <= 0.0)
+            return {};
+
+        impulse.applyGain ((float) (1.0 / std::sqrt (energy)));
+        return impulse;
+    }
+
+    //==============================================================================
+    template <typename SampleType>
+    void process (const juce::dsp::AudioBlock<SampleType>& block) noexcept
+    {
+        acquirePendingConvolver();
+
+        if (fadePosition < 0)
+        {
+            if (currentConvolver != nullptr)
+                currentConvolver->process (block);
+
+            return;
+        }
+
+        // crossfading: the new convolver runs on a copy of the input, in chunks that fit the buffer
+        auto maxChunkSize = (size_t) fadeBuffer.getNumSamples();
+        auto numChannelsToFade = juce::jmin (block.getNumChannels(), (size_t) fadeBuffer.getNumChannels());
+
+        for (size_t start = 0; start < block.getNumSamples() && maxChunkSize > 0; start += maxChunkSize)
+        {
+            auto chunk = block.getSubBlock (start, juce::jmin (maxChunkSize, block.getNumSamples() - start));
+            auto numSamples = chunk.getNumSamples();
+
+            for (size_t ch = 0; ch < numChannelsToFade; ++ch)
+                std::transform (chunk.getChannelPointer (ch), chunk.getChannelPointer (ch) + numSamples,
+                                fadeBuffer.getWritePointer ((int) ch), [] (SampleType x) { return (float) x; });
+
+            juce::dsp::AudioBlock<float> fadeBlock (fadeBuffer.getArrayOfWritePointers(), numChannelsToFade, numSamples);
+
+            if (currentConvolver != nullptr)
+                currentConvolver->process (chunk);
+
+            if (nextConvolver != nullptr)
+                nextConvolver->process (fadeBlock);
+
+            for (size_t ch = 0; ch < numChannelsToFade; ++ch)
+            {
+                auto* out = chunk.getChannelPointer (ch);
+                auto* in = fadeBuffer.getReadPointer ((int) ch);
+
+                for (size_t i = 0; i < numSamples; ++i)
+                {
+                    auto amount = (SampleType) juce::jmin (1.0f, (float) (fadePosition + (int) i) / (float) fadeLength);
+                    out[i] += amount * ((SampleType) in[i] - out[i]);
+                }
+            }
+
+            fadePosition += (int) numSamples;
+        }
+
+        if (fadePosition >= fadeLength)
+        {
+            // the old convolver waits in nextConvolver until it can be handed back for freeing
+            std::swap (currentConvolver, nextConvolver);
+            fadePosition = -1;
+        }
+    }
+
+private:
+    //==============================================================================
+    void acquirePendingConvolver() noexcept
+    {
+        if (fadePosition >= 0)
+            return;
+
+        if (nextConvolver != nullptr && ! convolvers.giveBack (nextConvolver))
+            return;
+
+        std::unique_ptr<NonUniformConvolver> convolver;
+
+        // nullptr unloads the response
+        if (! convolvers.collect (convolver) || (convolver == nullptr && currentConvolver == nullptr))
+            return;
+
+        nextConvolver = std::move (convolver);
+        fadePosition = 0;
+    }
+
+    //==============================================================================
+    size_t numChannels { 0 };
+    juce::AudioBuffer<float> fadeBuffer;
+
+    RealtimeHandover<NonUniformConvolver> convolvers;
+    std::atomic<int> latestLoad { 0 };
+    std::unique_ptr<NonUniformConvolver> currentConvolver, nextConvolver;
+    int fadePosition { -1 };
+};
@@ -0,0 +1,75 @@
+//
+//  Looper.cpp
+//  FilterPedal
+//
+
+#include "Looper.h"
+
+#if JUCE_UNIT_TESTS
+
+//==============================================================================
+class LooperTests : public juce::UnitTest
+{
+public:
+    LooperTests()
+        : juce::UnitTest ("Looper", "FilterPedal")
+    {
+    }
+
+    void runTest() override
+    {
+        beginTest ("Undo brings back the first take once an overdub has reached the disk");
+
+        Looper looper;
+        looper.prepare (sampleRate);
+
+        looper.setMode (Looper::recording);
+        looper.startStreamingIfWanted();
+
+        // a take a page and a half long, then an overdub over all of it and on past the page boundary again
+        run (looper, 0.5f, Looper::pageSize * 3 / 2);
+        looper.setMode (Looper::overdubbing);
+        run (looper, 0.25f, Looper::pageSize * 2);
+
+        looper.undo();
+
+        // once the pages have been restored and streamed back in, the whole loop is the first take alone
+        run (looper, 0.f, Looper::pageSize * 2);
+        auto played = run (looper, 0.f, Looper::pageSize * 2);
+
+        expectWithinAbsoluteError (played.getStart(), 0.5f, 1.0e-6f);
+        expectWithinAbsoluteError (played.getEnd(), 0.5f, 1.0e-6f);
+    }
+
+private:
+    static constexpr double sampleRate = 48000.0;
+    static constexpr int blockSize = 512;
+
+    /** Feeds numSamples of a constant input through the looper, about ten times faster
+        than real time so the streaming thread keeps up, and returns the range it played.
+    */
+    static juce::Range<float> run (Looper& looper, float input, int numSamples)
+    {
+        juce::AudioBuffer<float> buffer (Looper::numChannels, blockSize);
+        juce::Range<float> played;
+
+        for (int done = 0; done < numSamples; done += blockSize)
+        {
+            for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+                juce::FloatVectorOperations::fill (buffer.getWritePointer (ch), input, blockSize);
+
+            looper.process (juce::dsp::AudioBlock<float> (buffer));
+
+            auto blockRange = buffer.findMinMax (0, 0, blockSize);
+            played = done == 0 ? blockRange : played.getUnionWith (blockRange);
+
+            juce::Thread::sleep (1);
+        }
+
+        return played;
+    }
+};
+
+static LooperTests looperTests;
+
+#endif
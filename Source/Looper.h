@@ -0,0 +1,693 @@
+//
+//  Looper.h
+//  FilterPedal
+//
+
+#pragma once
+
+#include <JuceHeader.h>
+
+//==============================================================================
+/** Stereo looper with record, overdub, play and one level of undo, for loops far
+    longer than it keeps in memory.
+
+    The loop lives in a temporary file, cut into pages. The audio thread only ever
+    sees a few of them, in slots allocated up front: the page it's on, the next one
+    and, while a first take is running, the loop's first page, which it needs the
+    moment the take is closed. A background thread streams pages from the file into
+    free slots ahead of the audio thread, and writes the ones it recorded into back
+    once it has moved on. Each slot passes between the two threads through an atomic
+    state, so neither ever waits for the other: if the disk falls behind, the looper
+    drops out for a moment rather than blocking the audio thread, which never touches
+    a file.
+
+    Overdubs are undone page by page: before an overdubbed page is first written
+    back, the page it replaces is copied into a second file, and undo copies those
+    pages back. An overdub only records into a page once whatever earlier recording
+    it holds is on its way to disk, through a spare slot, so the page it replaces is
+    always the one on disk.
+
+    Nothing is allocated, no file is created and no thread runs until the first take
+    is asked for.
+*/
+class Looper : private juce::Thread
+{
+public:
+    //==============================================================================
+    enum Mode
+    {
+        stopped,
+        recording,
+        overdubbing,
+        playing
+    };
+
+    static constexpr int pageSize = 1 << 15;
+    static constexpr int numSlots = 4;
+    static constexpr int numChannels = 2;
+    static constexpr double maxLoopTime = 600.0;
+
+    //==============================================================================
+    Looper()
+        : juce::Thread ("Looper streaming")
+    {
+    }
+
+    ~Looper() override
+    {
+        stopThread (2000);
+
+        loopOutput.reset();
+        loopInput.reset();
+        undoOutput.reset();
+        undoInput.reset();
+
+        loopFile.deleteFile();
+        undoFile.deleteFile();
+    }
+
+    //==============================================================================
+    /** Clears the loop, which only holds good for one sample rate. */
+    void prepare (double sampleRate)
+    {
+        maxLoopLength = (juce::int64) (maxLoopTime * sampleRate);
+        clearLoop();
+    }
+
+    /** Message thread: sets up the slots and files and starts streaming, once a take has
+        been asked for. A take waits for its first page to be in memory before it starts.
+    */
+    void startStreamingIfWanted()
+    {
+        if (isThreadRunning() || ! streamingWanted.load (std::memory_order_acquire))
+            return;
+
+        auto tempDirectory = juce::File::getSpecialLocation (juce::File::tempDirectory);
+
+        loopFile = tempDirectory.getNonexistentChildFile ("FilterPedalLoop", ".tmp", false);
+        loopFile.create();
+
+        undoFile = tempDirectory.getNonexistentChildFile ("FilterPedalLoopUndo", ".tmp", false);
+        undoFile.create();
+
+        for (auto* slot : getAllSlots())
+            slot->buffer.setSize (numChannels, pageSize);
+
+        startThread (4);
+    }
+
+    //==============================================================================
+    /** Audio thread: switches the transport. Leaving recording closes the take, and
+        overdubbing or playing with no loop yet records one or stays stopped.
+    */
+    void setMode (Mode newMode) noexcept
+    {
+        if (newMode == mode)
+            return;
+
+        if (mode == recording)
+            closeTake();
+        else if (mode == overdubbing)
+            commitCurrentPage();
+
+        if (loopLength == 0 && newMode == overdubbing)
+            newMode = recording;
+        else if (loopLength == 0 && newMode == playing)
+            newMode = stopped;
+
+        switch (newMode)
+        {
+            case recording:
+                startTake();
+                break;
+
+            case overdubbing:
+                // whatever is only in memory now isn't part of this overdub, so it goes to disk first
+                commitCurrentPage();
+                overdubPass.store (++pass, std::memory_order_release);
+                hasOverdub = true;
+                break;
+
+            case stopped:
+                position = 0;
+                changePage (0);
+                break;
+
+            case playing:
+            default:
+                break;
+        }
+
+        mode = newMode;
+        notify();
+    }
+
+    Mode getMode() const noexcept
+    {
+        return mode;
+    }
+
+    /** Audio thread: takes back the last overdub, or clears the loop if there's only the first take. */
+    void undo() noexcept
+    {
+        if (mode == recording)
+            return;
+
+        if (! hasOverdub)
+        {
+            clearLoop();
+            return;
+        }
+
+        if (mode == overdubbing)
+            mode = playing;
+
+        // set before the slots are let go, so the streaming thread can't reload any of them unrestored
+        undonePass.store (pass, std::memory_order_release);
+
+        for (auto& slot : slots)
+        {
+            if (slot.state.load (std::memory_order_acquire) == Slot::ready)
+            {
+                // recording from before the overdub that's only in memory still has to reach the disk
+                slot.discard = slot.pass == pass;
+                retire (slot);
+            }
+        }
+
+        currentSlot = nullptr;
+        hasOverdub = false;
+        notify();
+    }
+
+    //==============================================================================
+    /** Audio thread: plays the loop into block, recording from it as the mode says. */
+    template <typename SampleType>
+    void process (const juce::dsp::AudioBlock<SampleType>& block) noexcept
+    {
+        if (mode == stopped)
+            return;
+
+        // the page wasn't in memory yet at the last block
+        if (currentSlot == nullptr)
+            changePage (currentPage);
+
+        // a take starts once it has somewhere to go
+        if (mode == recording && position == 0 && currentSlot == nullptr)
+            return;
+
+        auto numBlockChannels = juce::jmin (block.getNumChannels(), (size_t) numChannels);
+
+        for (size_t i = 0; i < block.getNumSamples(); ++i)
+        {
+            auto page = (int) (position / pageSize);
+
+            if (page != currentPage)
+                changePage (page);
+
+            if (currentSlot != nullptr)
+            {
+                auto offset = (int) (position % pageSize);
+
+                // until the overdub has the page to itself, it only plays it
+                auto pageMode = mode == overdubbing && ! claimCurrentPage() ? playing : mode;
+
+                for (size_t ch = 0; ch < numBlockChannels; ++ch)
+                {
+                    auto& sample = block.getChannelPointer (ch)[i];
+                    auto& stored = currentSlot->buffer.getWritePointer ((int) ch)[offset];
+
+                    switch (pageMode)
+                    {
+                        case recording:     stored = (float) sample; break;
+                        case overdubbing:   { auto input = (float) sample; sample += (SampleType) stored; stored += input; } break;
+                        case playing:       sample += (SampleType) stored; break;
+                        case stopped:
+                        default:            break;
+                    }
+                }
+
+                if (pageMode == recording || pageMode == overdubbing)
+                    currentSlot->dirty = true;
+            }
+
+            if (++position == loopLength)
+                position = 0;
+
+            if (mode == recording && position >= maxLoopLength)
+            {
+                closeTake();
+                mode = playing;
+            }
+        }
+    }
+
+private:
+    //==============================================================================
+    struct Slot
+    {
+        enum State
+        {
+            empty,      // the streaming thread's, to fill
+            ready,      // the audio thread's, holding page
+            retired     // the streaming thread's, to write back unless it's clean or discarded
+        };
+
+        juce::AudioBuffer<float> buffer;
+        std::atomic<int> page { -1 };
+        std::atomic<int> state { empty };
+
+        // only touched by the slot's owner of the moment
+        bool dirty { false }, discard { false };
+        int pass { 0 };     // the overdub its recording belongs to, 0 for a first take
+    };
+
+    /** The commit slot comes first, as it's always let go of before any slot holding the same page. */
+    std::array<Slot*, numSlots + 1> getAllSlots() noexcept
+    {
+        std::array<Slot*, numSlots + 1> all;
+        all[0] = &commitSlot;
+
+        for (int i = 0; i < numSlots; ++i)
+            all[(size_t) i + 1] = &slots[(size_t) i];
+
+        return all;
+    }
+
+    /** The pages that should be in memory while on page. */
+    static std::array<int, 3> getWindow (int page, int numLoopPages, bool firstTake) noexcept
+    {
+        auto next = numLoopPages > 0 ? (page + 1) % numLoopPages : page + 1;
+        return { page, next, firstTake ? 0 : -1 };
+    }
+
+    static bool isInWindow (const std::array<int, 3>& window, int page) noexcept
+    {
+        return std::find (window.begin(), window.end(), page) != window.end();
+    }
+
+    //==============================================================================
+    // audio thread
+
+    static void retire (Slot& slot) noexcept
+    {
+        slot.state.store (Slot::retired, std::memory_order_release);
+    }
+
+    int getNumLoopPages() const noexcept
+    {
+        return (int) ((loopLength + pageSize - 1) / pageSize);
+    }
+
+    /** Moves onto page, letting go of the pages that aren't needed any more and handing
+        the one just left over for writing back if it was recorded into.
+    */
+    void changePage (int page) noexcept
+    {
+        auto window = getWindow (page, getNumLoopPages(), takeActive.load (std::memory_order_relaxed));
+        Slot* newSlot = nullptr;
+
+        for (auto& slot : slots)
+        {
+            if (slot.state.load (std::memory_order_acquire) != Slot::ready)
+                continue;
+
+            auto slotPage = slot.page.load (std::memory_order_relaxed);
+
+            if (slotPage == page && newSlot == nullptr && ! (&slot == currentSlot && slot.dirty && page != currentPage))
+                newSlot = &slot;
+            else if (! isInWindow (window, slotPage) || (&slot == currentSlot && slot.dirty))
+                retire (slot);
+        }
+
+        currentSlot = newSlot;
+        currentPage = page;
+        playPage.store (page, std::memory_order_release);
+        notify();
+    }
+
+    /** Copies the current page, if it holds recording that's only in memory, into the
+        spare slot for writing back, so the page itself can stay in use.
+    */
+    void commitCurrentPage() noexcept
+    {
+        if (currentSlot == nullptr || ! currentSlot->dirty)
+            return;
+
+        // still writing the last one back: the page stays dirty and goes back when it's left
+        if (commitSlot.state.load (std::memory_order_acquire) != Slot::empty)
+            return;
+
+        for (int ch = 0; ch < numChannels; ++ch)
+            juce::FloatVectorOperations::copy (commitSlot.buffer.getWritePointer (ch), currentSlot->buffer.getReadPointer (ch), pageSize);
+
+        commitSlot.page.store (currentSlot->page.load (std::memory_order_relaxed), std::memory_order_relaxed);
+        commitSlot.dirty = true;
+        commitSlot.discard = false;
+        commitSlot.pass = currentSlot->pass;
+        retire (commitSlot);
+
+        currentSlot->dirty = false;
+    }
+
+    /** Makes the current page part of this overdub, committing any earlier recording it
+        holds first. Fails while that can't be done yet.
+    */
+    bool claimCurrentPage() noexcept
+    {
+        if (currentSlot->pass == pass)
+            return true;
+
+        commitCurrentPage();
+
+        if (currentSlot->dirty)
+            return false;
+
+        currentSlot->pass = pass;
+        return true;
+    }
+
+    void startTake() noexcept
+    {
+        // the old loop's pages mean nothing now, apart from one slot kept to record the first page into
+        Slot* firstPage = nullptr;
+
+        for (auto& slot : slots)
+        {
+            if (slot.state.load (std::memory_order_acquire) != Slot::ready)
+                continue;
+
+            if (firstPage == nullptr)
+            {
+                firstPage = &slot;
+            }
+            else
+            {
+                slot.discard = true;
+                retire (slot);
+            }
+        }
+
+        if (firstPage != nullptr)
+        {
+            firstPage->page.store (0, std::memory_order_relaxed);
+            firstPage->dirty = false;
+            firstPage->pass = 0;
+        }
+
+        position = 0;
+        loopLength = 0;
+        hasOverdub = false;
+        streamingWanted.store (true, std::memory_order_release);
+        takeActive.store (true, std::memory_order_relaxed);
+        numPages.store (0, std::memory_order_relaxed);
+
+        currentSlot = nullptr;
+        currentPage = -1;
+        changePage (0);
+    }
+
+    void closeTake() noexcept
+    {
+        loopLength = position;
+        position = 0;
+
+        commitCurrentPage();
+
+        takeActive.store (false, std::memory_order_relaxed);
+        numPages.store (getNumLoopPages(), std::memory_order_relaxed);
+
+        if (loopLength == 0)
+            mode = stopped;
+
+        changePage (0);
+    }
+
+    void clearLoop() noexcept
+    {
+        for (auto& slot : slots)
+        {
+            if (slot.state.load (std::memory_order_acquire) == Slot::ready && slot.dirty)
+            {
+                slot.discard = true;
+                retire (slot);
+            }
+        }
+
+        mode = stopped;
+        position = 0;
+        loopLength = 0;
+        hasOverdub = false;
+        takeActive.store (false, std::memory_order_relaxed);
+        numPages.store (0, std::memory_order_relaxed);
+
+        currentSlot = nullptr;
+        changePage (0);
+    }
+
+    //==============================================================================
+    // streaming thread
+
+    void run() override
+    {
+        juce::AudioBuffer<float> scratch (numChannels, pageSize);
+
+        while (! threadShouldExit())
+        {
+            writeBackRetiredSlots (scratch);
+
+            if (auto undone = undonePass.exchange (0, std::memory_order_acquire); undone > 0)
+            {
+                // anything let go before the undo was asked for has to be on disk before it's undone
+                writeBackRetiredSlots (scratch);
+                restoreUndonePages (undone, scratch);
+            }
+
+            loadWantedPages();
+
+            if (loopOutput != nullptr)
+                loopOutput->flush();
+
+            wait (10);
+        }
+    }
+
+    void writeBackRetiredSlots (juce::AudioBuffer<float>& scratch)
+    {
+        for (auto* slot : getAllSlots())
+        {
+            if (slot->state.load (std::memory_order_acquire) != Slot::retired)
+                continue;
+
+            auto page = slot->page.load (std::memory_order_relaxed);
+
+            if (slot->dirty && ! slot->discard && page >= 0)
+            {
+                // only the latest overdub can be undone
+                if (slot->pass > 0 && slot->pass == overdubPass.load (std::memory_order_acquire))
+                    saveForUndo (page, slot->pass, scratch);
+
+                writePage (getLoopOutput(), *slot, page);
+            }
+
+            slot->dirty = false;
+            slot->discard = false;
+            slot->state.store (Slot::empty, std::memory_order_release);
+        }
+    }
+
+    void loadWantedPages()
+    {
+        auto page = playPage.load (std::memory_order_acquire);
+        auto firstTake = takeActive.load (std::memory_order_relaxed);
+
+        for (auto wanted : getWindow (page, numPages.load (std::memory_order_relaxed), firstTake))
+        {
+            // a page still waiting to be written back is loaded once it has been
+            if (wanted < 0 || isResident (wanted) || isWritePending (wanted))
+                continue;
+
+            auto* slot = findEmptySlot();
+
+            if (slot == nullptr)
+                return;
+
+            // a first take hasn't reached its coming pages yet, so there's nothing to read for them
+            if (firstTake && wanted >= page)
+                slot->buffer.clear();
+            else
+                readPage (getLoopInput(), slot->buffer, wanted);
+
+            slot->page.store (wanted, std::memory_order_relaxed);
+            slot->dirty = false;
+            slot->discard = false;
+            slot->pass = 0;
+            slot->state.store (Slot::ready, std::memory_order_release);
+        }
+    }
+
+    bool isResident (int page) const noexcept
+    {
+        for (auto& slot : slots)
+            if (slot.state.load (std::memory_order_acquire) == Slot::ready && slot.page.load (std::memory_order_relaxed) == page)
+                return true;
+
+        return false;
+    }
+
+    bool isWritePending (int page) noexcept
+    {
+        for (auto* slot : getAllSlots())
+            if (slot->state.load (std::memory_order_acquire) == Slot::retired && slot->page.load (std::memory_order_relaxed) == page)
+                return true;
+
+        return false;
+    }
+
+    Slot* findEmptySlot() noexcept
+    {
+        for (auto& slot : slots)
+            if (slot.state.load (std::memory_order_acquire) == Slot::empty)
+                return &slot;
+
+        return nullptr;
+    }
+
+    //==============================================================================
+    void saveForUndo (int page, int slotPass, juce::AudioBuffer<float>& scratch)
+    {
+        // a new overdub starts a new undo
+        if (slotPass != savedPass)
+        {
+            savedPages.clear();
+            savedPass = slotPass;
+        }
+
+        if ((size_t) page >= savedPages.size())
+            savedPages.resize ((size_t) page + 1, false);
+
+        if (savedPages[(size_t) page])
+            return;
+
+        readPage (getLoopInput(), scratch, page);
+        writePage (getUndoOutput(), scratch, page);
+        getUndoOutput().flush();
+
+        savedPages[(size_t) page] = true;
+    }
+
+    /** Puts back the pages an overdub replaced, if it got as far as the disk. */
+    void restoreUndonePages (int undone, juce::AudioBuffer<float>& scratch)
+    {
+        if (undone != savedPass)
+            savedPages.clear();
+
+        for (size_t page = 0; page < savedPages.size(); ++page)
+        {
+            if (! savedPages[page])
+                continue;
+
+            readPage (getUndoInput(), scratch, (int) page);
+            writePage (getLoopOutput(), scratch, (int) page);
+        }
+
+        getLoopOutput().flush();
+        savedPages.clear();
+    }
+
+    //==============================================================================
+    static juce::int64 getPageOffset (int page, int channel) noexcept
+    {
+        return ((juce::int64) page * numChannels + channel) * pageSize * (juce::int64) sizeof (float);
+    }
+
+    static void writePage (juce::FileOutputStream& stream, const Slot& slot, int page)
+    {
+        writePage (stream, slot.buffer, page);
+    }
+
+    static void writePage (juce::FileOutputStream& stream, const juce::AudioBuffer<float>& buffer, int page)
+    {
+        for (int ch = 0; ch < numChannels; ++ch)
+        {
+            stream.setPosition (getPageOffset (page, ch));
+            stream.write (buffer.getReadPointer (ch), (size_t) pageSize * sizeof (float));
+        }
+    }
+
+    static void readPage (juce::FileInputStream& stream, juce::AudioBuffer<float>& buffer, int page)
+    {
+        for (int ch = 0; ch < numChannels; ++ch)
+        {
+            auto* data = buffer.getWritePointer (ch);
+
+            stream.setPosition (getPageOffset (page, ch));
+            auto numRead = juce::jmax (0, stream.read (data, pageSize * (int) sizeof (float))) / (int) sizeof (float);
+
+            // past the end of what's been written so far is silence
+            juce::FloatVectorOperations::clear (data + numRead, pageSize - numRead);
+        }
+    }
+
+    juce::FileOutputStream& getLoopOutput()
+    {
+        if (loopOutput == nullptr)
+            loopOutput = std::make_unique<juce::FileOutputStream> (loopFile);
+
+        return *loopOutput;
+    }
+
+    juce::FileInputStream& getLoopInput()
+    {
+        if (loopOutput != nullptr)
+            loopOutput->flush();
+
+        if (loopInput == nullptr)
+            loopInput = std::make_unique<juce::FileInputStream> (loopFile);
+
+        return *loopInput;
+    }
+
+    juce::FileOutputStream& getUndoOutput()
+    {
+        if (undoOutput == nullptr)
+            undoOutput = std::make_unique<juce::FileOutputStream> (undoFile);
+
+        return *undoOutput;
+    }
+
+    juce::FileInputStream& getUndoInput()
+    {
+        if (undoOutput != nullptr)
+            undoOutput->flush();
+
+        if (undoInput == nullptr)
+            undoInput = std::make_unique<juce::FileInputStream> (undoFile);
+
+        return *undoInput;
+    }
+
+    //==============================================================================
+    std::array<Slot, numSlots> slots;
+    Slot commitSlot;
+
+    // shared between the threads
+    std::atomic<int> playPage { 0 }, numPages { 0 }, overdubPass { 0 }, undonePass { 0 };
+    std::atomic<bool> takeActive { false }, streamingWanted { false };
+
+    // the audio thread's
+    Mode mode { stopped };
+    juce::int64 position { 0 }, loopLength { 0 }, maxLoopLength { 0 };
+    int currentPage { -1 }, pass { 0 };
+    Slot* currentSlot { nullptr };
+    bool hasOverdub { false };
+
+    // the streaming thread's
+    juce::File loopFile, undoFile;
+    std::unique_ptr<juce::FileOutputStream> loopOutput, undoOutput;
+    std::unique_ptr<juce::FileInputStream> loopInput, undoInput;
+    std::vector<bool> savedPages;
+    int savedPass { 0 };
+
+    JUCE_DECLARE_NON_COPYABLE (Looper)
+};
@@ -239,60 +239,25 @@ juce::String RotarySliderWithLabels::getDisplayString() const
 ResponseCurveComponent::ResponseCurveComponent(FilterPedalAudioProcessor& p) :
 audioProcessor(p)
 {
-    const auto& params = audioProcessor.getParameters();
-    for( auto param : params )
-    {
-        param->addListener(this);
-    }
-
     //48000 / 2048 = 23hz
 
-    updateChain();
+    audioProcessor.invalidateResponseModel();
 
     startTimerHz(60);
 }
 
 ResponseCurveComponent::~ResponseCurveComponent()
 {
-    const auto& params = audioProcessor.getParameters();
-    for( auto param : params )
-    {
-        param->removeListener(this);
-    }
-}
-
-void ResponseCurveComponent::parameterValueChanged(int parameterIndex, float newValue)
-{
-    parametersChanged.set(true);
 }
 
 void ResponseCurveComponent::timerCallback()
 {
-
-    if( parametersChanged.compareAndSetBool(false, true) )
+    // the processor designs the filters and publishes their coefficients,
+    // so all we have to do here is pick up the newest set
+    if( audioProcessor.getLatestResponseModel(responseModel) )
     {
-        //update the monochain
-        updateChain();
-        // signal a repaint
-//        repaint();
+        repaint();
     }
-
-    repaint();
-}
-
-void ResponseCurveComponent::updateChain()
-{
-    auto chainSettings = getChainSettings(audioProcessor.apvts);
-
-    monoChain.setBypassed<ChainPositions::LowCut>(chainSettings.lowCutBypassed);
-    monoChain.setBypassed<ChainPositions::HighCut>(chainSettings.highCutBypassed);
-
-    auto lowCutCoefficients = makeLowCutFilter(chainSettings, audioProcessor.getSampleRate());
-    auto highCutCoefficients = makeHighCutFilter(chainSettings, audioProcessor.getSampleRate());
-
-    updateCutFilter(monoChain.get<ChainPositions::LowCut>(), lowCutCoefficients, chainSettings.lowCutSlope);
-    updateCutFilter(monoChain.get<ChainPositions::HighCut>(), highCutCoefficients, chainSettings.highCutSlope);
-    updateDistortionGain(monoChain.get<ChainPositions::WaveshapingDistortion>(), chainSettings);
 }
 
 void ResponseCurveComponent::paint (juce::Graphics& g)
@@ -307,58 +272,27 @@ void ResponseCurveComponent::paint (juce::Graphics& g)
 
     auto w = responseArea.getWidth();
 
-    auto& lowcut = monoChain.get<ChainPositions::LowCut>();
-    auto& highcut = monoChain.get<ChainPositions::HighCut>();
-    auto& distortion = monoChain.get<ChainPositions::WaveshapingDistortion>();
-
-    auto sampleRate = audioProcessor.getSampleRate();
-
     std::vector<double> mags;
 
     mags.resize(w);
 
     for( int i = 0; i < w; ++i )
     {
-        double mag = 1.f;
         auto freq = mapToLog10(double(i) / double(w), 20.0, 20000.0);
 
-        if ( !monoChain.isBypassed<ChainPositions::LowCut>() )
-        {
-            if (! lowcut.isBypassed<0>() )
-                mag *= lowcut.get<0>().coefficients->getMagnitudeForFrequency(freq, sampleRate);
-            if (! lowcut.isBypassed<1>() )
-                mag *= lowcut.get<1>().coefficients->getMagnitudeForFrequency(freq, sampleRate);
-            if (! lowcut.isBypassed<2>() )
-                mag *= lowcut.get<2>().coefficients->getMagnitudeForFrequency(freq, sampleRate);
-            if (! lowcut.isBypassed<3>() )
-                mag *= lowcut.get<3>().coefficients->getMagnitudeForFrequency(freq, sampleRate);
-        }
-
-        if ( !monoChain.isBypassed<ChainPositions::HighCut>() )
-        {
-            if (! highcut.isBypassed<0>() )
-                mag *= highcut.get<0>().coefficients->getMagnitudeForFrequency(freq, sampleRate);
-            if (! highcut.isBypassed<1>() )
-                mag *= highcut.get<1>().coefficients->getMagnitudeForFrequency(freq, sampleRate);
-            if (! highcut.isBypassed<2>() )
-                mag *= highcut.get<2>().coefficients->getMagnitudeForFrequency(freq, sampleRate);
-            if (! highcut.isBypassed<3>() )
-                mag *= highcut.get<3>().coefficients->getMagnitudeForFrequency(freq, sampleRate);
-        }
-
-        mags[i] = Decibels::gainToDecibels(mag);
+        mags[i] = Decibels::gainToDecibels(responseModel.getMagnitudeForFrequency(freq));
     }
     
     auto distortionPreGain {0.f};
-    if ( !monoChain.isBypassed<ChainPositions::WaveshapingDistortion>() )
+    if ( !responseModel.distortionBypassed )
     {
-        distortionPreGain = distortion.get<0>().getPreGain();
+        distortionPreGain = responseModel.distortionPreGain;
     }
     
     auto distortionPostGain {0.f};
-    if ( !monoChain.isBypassed<ChainPositions::WaveshapingDistortion>() )
+    if ( !responseModel.distortionBypassed )
     {
-        distortionPostGain = distortion.get<0>().getPostGain();
+        distortionPostGain = responseModel.distortionPostGain;
     }
 
     Path responseCurve;
@@ -679,6 +613,30 @@ delayBypassButtonAttachment(audioProcessor.apvts, "Delay Bypassed", delayBypassB
         }
     };
     
+    cabinetLoadButton.onClick = [safePtr]()
+    {
+        if( auto* comp = safePtr.getComponent() )
+        {
+            comp->cabinetChooser = std::make_unique<juce::FileChooser>("Load a cabinet impulse response",
+                                                                       comp->audioProcessor.getCabinetImpulseResponseFile(),
+                                                                       "*.wav");
+            
+            comp->cabinetChooser->launchAsync(juce::FileBrowserComponent::openMode | juce::FileBrowserComponent::canSelectFiles,
+                                              [safePtr](const juce::FileChooser& chooser)
+            {
+                auto file = chooser.getResult();
+                
+                if( auto* comp = safePtr.getComponent(); comp != nullptr && file.existsAsFile() )
+                {
+                    comp->audioProcessor.loadCabinetImpulseResponse(file);
+                    comp->updateCabinetButtonText();
+                }
+            });
+        }
+    };
+    
+    updateCabinetButtonText();
+    
     setSize (700, 500);
 }
 
@@ -690,6 +648,12 @@ FilterPedalAudioProcessorEditor::~FilterPedalAudioProcessorEditor()
     delayBypassButton.setLookAndFeel(nullptr);
 }
 
+void FilterPedalAudioProcessorEditor::updateCabinetButtonText()
+{
+    auto file = audioProcessor.getCabinetImpulseResponseFile();
+    cabinetLoadButton.setButtonText(file == juce::File() ? "Load Cab IR" : "Cab: " + file.getFileNameWithoutExtension());
+}
+
 //==============================================================================
 void FilterPedalAudioProcessorEditor::paint (juce::Graphics& g)
 {
@@ -776,6 +740,7 @@ void FilterPedalAudioProcessorEditor::resized()
     highCutSlopeSlider.setBounds(highCutArea);
     
     distortionBypassButton.setBounds(distortionButtonArea.reduced(distortionBounds.getWidth() * 0.4, 0));
+    cabinetLoadButton.setBounds(distortionBounds.removeFromBottom(buttonHeight).reduced(5, 0));
     distortionPreGainSlider.setBounds(distortionBounds.removeFromTop(distortionBounds.getHeight() * 0.5));
     distortionPostGainSlider.setBounds(distortionBounds);
     
@@ -817,6 +782,7 @@ std::vector<juce::Component*> FilterPedalAudioProcessorEditor::getComps()
         &lowcutBypassButton,
         &highcutBypassButton,
         &distortionBypassButton,
-        &delayBypassButton
+        &delayBypassButton,
+        &cabinetLoadButton
     };
 }
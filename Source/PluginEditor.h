@@ -64,27 +64,19 @@ private:
 };
 
 struct ResponseCurveComponent: juce::Component,
-juce::AudioProcessorParameter::Listener,
 juce::Timer
 {
     ResponseCurveComponent(FilterPedalAudioProcessor&);
     ~ResponseCurveComponent();
 
-    void parameterValueChanged (int parameterIndex, float newValue) override;
-
-    void parameterGestureChanged (int parameterIndex, bool gestureIsStarting) override { }
-
     void timerCallback() override;
 
     void paint(juce::Graphics& g) override;
     void resized() override;
 private:
     FilterPedalAudioProcessor& audioProcessor;
-    juce::Atomic<bool> parametersChanged { false };
-
-    MonoChain monoChain;
 
-    void updateChain();
+    ResponseModel responseModel;
 
     juce::Image background;
 
@@ -157,6 +149,12 @@ private:
                      distortionBypassButtonAttachment,
                      delayBypassButtonAttachment;
     
+    /** Picks the cabinet's impulse response; it shows the loaded file's name. */
+    juce::TextButton cabinetLoadButton;
+    std::unique_ptr<juce::FileChooser> cabinetChooser;
+    
+    void updateCabinetButtonText();
+    
     std::vector<juce::Component*> getComps();
     
     LookAndFeel lnf;
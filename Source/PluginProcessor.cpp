@@ -16,16 +16,36 @@ FilterPedalAudioProcessor::FilterPedalAudioProcessor()
                      #if ! JucePlugin_IsMidiEffect
                       #if ! JucePlugin_IsSynth
                        .withInput  ("Input",  juce::AudioChannelSet::stereo(), true)
+                       .withInput  ("Sidechain", juce::AudioChannelSet::stereo(), false)
                       #endif
                        .withOutput ("Output", juce::AudioChannelSet::stereo(), true)
                      #endif
                        )
 #endif
 {
+    auto maxDelayTime = juce::jmax(apvts.getParameterRange("Delay Time Left").end,
+                                   apvts.getParameterRange("Delay Time Right").end);
+    
+    floatChains.delay.setMaxDelayTime(maxDelayTime);
+    doubleChains.delay.setMaxDelayTime(maxDelayTime);
+    
+    for( auto* param : getParameters() )
+        param->addListener(this);
+    
+    publishFilterDesigns(getChainSettings(apvts));
+    
+    startTimerHz(30);
 }
 
 FilterPedalAudioProcessor::~FilterPedalAudioProcessor()
 {
+    stopTimer();
+    
+    for( auto* param : getParameters() )
+        param->removeListener(this);
+    
+    releaseDelay<float>();
+    releaseDelay<double>();
 }
 
 //==============================================================================
@@ -104,16 +124,124 @@ void FilterPedalAudioProcessor::prepareToPlay (double sampleRate, int samplesPer
     
     spec.sampleRate = sampleRate;
     
-    leftChain.prepare(spec);
-    rightChain.prepare(spec);
+    for( auto* chain : { &floatChains.left, &floatChains.right } )
+    {
+        prepareCutFilterCoefficients(chain->get<ChainPositions::LowCut>());
+        prepareCutFilterCoefficients(chain->get<ChainPositions::HighCut>());
+        chain->prepare(spec);
+    }
+    
+    for( auto* chain : { &doubleChains.left, &doubleChains.right } )
+    {
+        prepareCutFilterCoefficients(chain->get<ChainPositions::LowCut>());
+        prepareCutFilterCoefficients(chain->get<ChainPositions::HighCut>());
+        chain->prepare(spec);
+    }
+    
+    auto prepareSvfs = [&spec](auto& chains)
+    {
+        for( auto& svf : chains.lowCutSvfs )
+        {
+            svf.setMode(std::decay_t<decltype(svf)>::highPass);
+            svf.prepare(spec);
+        }
+        
+        for( auto& svf : chains.highCutSvfs )
+        {
+            svf.setMode(std::decay_t<decltype(svf)>::lowPass);
+            svf.prepare(spec);
+        }
+    };
+    
+    prepareSvfs(floatChains);
+    prepareSvfs(doubleChains);
+    
+    for( auto& distortion : floatChains.multibandDistortions )
+        distortion.prepare(spec);
+    
+    for( auto& distortion : doubleChains.multibandDistortions )
+        distortion.prepare(spec);
+    
+    spec.numChannels = 2;
+    
+    floatChains.delay.prepare(spec);
+    doubleChains.delay.prepare(spec);
+    
+    floatChains.limiter.prepare(spec);
+    doubleChains.limiter.prepare(spec);
+    
+    // only the buffers the host's precision will use get any memory
+    auto useDoublePrecision = isUsingDoublePrecision();
+    
+    floatChains.stageDryBuffer.setSize(2, useDoublePrecision ? 0 : samplesPerBlock);
+    doubleChains.stageDryBuffer.setSize(2, useDoublePrecision ? samplesPerBlock : 0);
+    mixedPrecisionBuffer.setSize(2, useDoublePrecision ? 0 : samplesPerBlock);
+    
+    if( useDoublePrecision )
+        doubleChains.envelopeFollower.prepare(spec);
+    else
+        floatChains.envelopeFollower.prepare(spec);
+    
+    modulationBuffer.setSize(numModulationDestinations, samplesPerBlock);
+    envelopeBuffer.setSize(1, samplesPerBlock);
+    lfoBuffer.setSize((int) numLfos, samplesPerBlock);
+    
+    for( auto& lfo : lfos )
+        lfo.prepare(sampleRate);
     
-    updateComponents();
+    linearPhaseFilter->prepare(sampleRate, 2);
+    
+    cabinet->prepare(samplesPerBlock, 2);
+    updateCabinet();
+    
+    looper.prepare(sampleRate);
+    looperModeRequested = Looper::stopped;
+    
+    // nothing is processing yet, so the first designs can go straight into the filters
+    auto chainSettings = getChainSettings(apvts);
+    auto designs = designFilters(chainSettings, sampleRate, *sharedResources);
+    applyFilterDesigns(designs);
+    designLinearPhaseKernel(designs, false);
+    filterDesignsChanged = true;
+    
+    updateLatency(chainSettings);
+    
+    delayBypassedSinceMs = juce::Time::getMillisecondCounter();
+    
+    updateDelayMemory();
+    
+    activeChainOrder = chainSettings.chainOrder;
+    chainOrderFadeSamples = juce::jmax(1, juce::roundToInt(sampleRate * 0.005));
+    chainOrderFadePosition = -1;
+    
+    auto stageEnabled = std::array<bool, 6> { ! chainSettings.lowCutBypassed, ! chainSettings.highCutBypassed,
+                                              ! chainSettings.distortionBypassed, ! chainSettings.delayBypassed,
+                                              ! chainSettings.cabinetBypassed,
+                                              ! chainSettings.gateBypassed || chainSettings.gateLookahead > 0.f };
+    
+    for( size_t position = 0; position < stageMixes.size(); ++position )
+    {
+        stageMixes[position].reset(sampleRate, 0.005);
+        stageMixes[position].setCurrentAndTargetValue(stageEnabled[position] ? 1.f : 0.f);
+    }
+    
+    if( useDoublePrecision )
+        updateComponents<double>(chainSettings);
+    else
+        updateComponents<float>(chainSettings);
+    
+    // start the state variable filters at their cutoffs rather than sweeping there
+    resetCutFilter<ChainPositions::LowCut>();
+    resetCutFilter<ChainPositions::HighCut>();
 }
 
 void FilterPedalAudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
     // spare memory, etc.
+    
+    releaseDelay<float>();
+    releaseDelay<double>();
 }
 
 #ifndef JucePlugin_PreferredChannelConfigurations
@@ -135,6 +263,17 @@ bool FilterPedalAudioProcessor::isBusesLayoutSupported (const BusesLayout& layou
    #if ! JucePlugin_IsSynth
     if (layouts.getMainOutputChannelSet() != layouts.getMainInputChannelSet())
         return false;
+    
+    // The optional sidechain only feeds the envelope follower, which takes mono or stereo
+    if (layouts.inputBuses.size() > 1)
+    {
+        auto sidechain = layouts.getChannelSet(true, 1);
+        
+        if (! sidechain.isDisabled()
+         && sidechain != juce::AudioChannelSet::mono()
+         && sidechain != juce::AudioChannelSet::stereo())
+            return false;
+    }
    #endif
 
     return true;
@@ -143,6 +282,22 @@ bool FilterPedalAudioProcessor::isBusesLayoutSupported (const BusesLayout& layou
 #endif
 
 void FilterPedalAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
+{
+    processSamples(buffer);
+}
+
+void FilterPedalAudioProcessor::processBlock (juce::AudioBuffer<double>& buffer, juce::MidiBuffer& midiMessages)
+{
+    processSamples(buffer);
+}
+
+bool FilterPedalAudioProcessor::supportsDoublePrecisionProcessing() const
+{
+    return true;
+}
+
+template<typename SampleType>
+void FilterPedalAudioProcessor::processSamples(juce::AudioBuffer<SampleType>& buffer)
 {
     juce::ScopedNoDenormals noDenormals;
     auto totalNumInputChannels  = getTotalNumInputChannels();
@@ -157,18 +312,367 @@ void FilterPedalAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
         buffer.clear (i, 0, buffer.getNumSamples());
     
-    updateComponents();
+    auto chainSettings = getChainSettings(apvts);
+    followReportedLatency(chainSettings);
+    
+    updateComponents<SampleType>(chainSettings);
+    updateModulation(chainSettings, buffer);
 
-    juce::dsp::AudioBlock<float> block(buffer);
+    // only the main bus is processed; the sidechain is just listened to
+    auto mainBuffer = getBusBuffer(buffer, false, 0);
+    juce::dsp::AudioBlock<SampleType> block(mainBuffer);
 
-    auto leftBlock = block.getSingleChannelBlock(0);
-    auto rightBlock = block.getSingleChannelBlock(1);
+    processChain(chainSettings, block);
+    
+    updateLooper(chainSettings);
+    looper.process(block);
+    
+    auto& chains = getChains<SampleType>();
+    
+    if( chains.limiterActive )
+        chains.limiter.process(juce::dsp::ProcessContextReplacing<SampleType>(block));
+}
+
+namespace
+{
+    template<typename SampleType>
+    void applyGainRamp(const juce::dsp::AudioBlock<SampleType>& block, SampleType startGain, SampleType endGain)
+    {
+        auto numSamples = block.getNumSamples();
+        auto increment = (endGain - startGain) / (SampleType) juce::jmax(numSamples, (size_t) 1);
+        
+        for( size_t ch = 0; ch < block.getNumChannels(); ++ch )
+        {
+            auto* data = block.getChannelPointer(ch);
+            
+            for( size_t i = 0; i < numSamples; ++i )
+                data[i] *= startGain + increment * (SampleType) (i + 1);
+        }
+    }
+}
+
+template<typename SampleType, size_t... OrderIndices>
+constexpr std::array<FilterPedalAudioProcessor::ChainOrderProcessor<SampleType>, sizeof...(OrderIndices)>
+FilterPedalAudioProcessor::makeChainOrderProcessors(std::index_sequence<OrderIndices...>)
+{
+    return { &FilterPedalAudioProcessor::processInOrder<OrderIndices, SampleType>... };
+}
+
+template<size_t OrderIndex, typename SampleType>
+void FilterPedalAudioProcessor::processInOrder(juce::dsp::AudioBlock<SampleType>& block, size_t startSample)
+{
+    // each ordering is its own instantiation, so the stages are called directly with no per-stage dispatch
+    inputGateSilent = false;
+    
+    processPosition<chainOrders[OrderIndex][0]>(block, startSample);
+    processPosition<chainOrders[OrderIndex][1]>(block, startSample);
+    processPosition<chainOrders[OrderIndex][2]>(block, startSample);
+    processPosition<chainOrders[OrderIndex][3]>(block, startSample);
+}
+
+template<int Position, typename SampleType>
+void FilterPedalAudioProcessor::processPosition(juce::dsp::AudioBlock<SampleType>& block, size_t startSample)
+{
+    // the gate and the cab surround the pedal, wherever the order puts the pedal
+    if constexpr (Position == ChainPositions::WaveshapingDistortion)
+        processStage<ChainPositions::InputGate>(block, startSample);
+    
+    processStage<Position>(block, startSample);
+    
+    if constexpr (Position == ChainPositions::WaveshapingDistortion)
+        processStage<ChainPositions::CabinetSimulator>(block, startSample);
+}
+
+template<int Position, typename SampleType>
+void FilterPedalAudioProcessor::processStage(juce::dsp::AudioBlock<SampleType>& block, size_t startSample)
+{
+    auto& mix = stageMixes[Position];
+    auto& chains = getChains<SampleType>();
+    
+    if( ! mix.isSmoothing() )
+    {
+        if( mix.getCurrentValue() > 0.f )
+        {
+            runStage<Position>(block, startSample);
+        }
+        else
+        {
+            // a bypassed stage costs nothing, apart from a delay asked to keep its line warm
+            if constexpr (Position == ChainPositions::DistortedDelay)
+                if( delayBypassMode == DelayBypassMode::DelayBypass_KeepWarm )
+                    chains.delay.keepWarm(block.getSubsetChannelBlock(0, juce::jmin(block.getNumChannels(), (size_t) 2)));
+        }
+        
+        return;
+    }
+    
+    // The stage was just switched on or off, so its output is crossfaded with its input,
+    // working through the block in chunks that fit the preallocated dry buffer.
+    auto& dryBuffer = chains.stageDryBuffer;
+    auto numChannels = juce::jmin(block.getNumChannels(), (size_t) dryBuffer.getNumChannels());
+    auto maxChunkSize = (size_t) dryBuffer.getNumSamples();
+    
+    if( maxChunkSize == 0 )
+    {
+        runStage<Position>(block, startSample);
+        mix.skip((int) block.getNumSamples());
+        return;
+    }
+    
+    for( size_t start = 0; start < block.getNumSamples(); start += maxChunkSize )
+    {
+        auto chunk = block.getSubBlock(start, juce::jmin(maxChunkSize, block.getNumSamples() - start));
+        auto numSamples = chunk.getNumSamples();
+        
+        for( size_t ch = 0; ch < numChannels; ++ch )
+            juce::FloatVectorOperations::copy(dryBuffer.getWritePointer((int) ch), chunk.getChannelPointer(ch), (int) numSamples);
+        
+        runStage<Position>(chunk, startSample + start);
+        
+        for( size_t i = 0; i < numSamples; ++i )
+        {
+            auto wetAmount = (SampleType) mix.getNextValue();
+            
+            for( size_t ch = 0; ch < numChannels; ++ch )
+            {
+                auto dry = dryBuffer.getReadPointer((int) ch)[i];
+                auto* out = chunk.getChannelPointer(ch);
+                out[i] = dry + wetAmount * (out[i] - dry);
+            }
+        }
+    }
+}
+
+template<int Position, typename SampleType>
+void FilterPedalAudioProcessor::runStage(juce::dsp::AudioBlock<SampleType>& block, size_t startSample)
+{
+    auto& chains = getChains<SampleType>();
+    
+    if constexpr (Position == ChainPositions::InputGate)
+    {
+        std::array<MonoChain<SampleType>*, 2> monoChains { &chains.left, &chains.right };
+        auto silent = true;
+        
+        for( size_t ch = 0; ch < juce::jmin(block.getNumChannels(), monoChains.size()); ++ch )
+        {
+            auto channelBlock = block.getSingleChannelBlock(ch);
+            juce::dsp::ProcessContextReplacing<SampleType> context(channelBlock);
+            
+            auto& gate = monoChains[ch]->template get<monoChainGateIndex>();
+            gate.process(context);
+            silent = silent && gate.isSilent();
+        }
+        
+        // while the stage is fading in or out its output still carries the dry input, which isn't silent
+        auto& mix = stageMixes[ChainPositions::InputGate];
+        inputGateSilent = silent && ! mix.isSmoothing() && mix.getCurrentValue() == 1.f;
+    }
+    else if constexpr (Position == ChainPositions::CabinetSimulator)
+    {
+        cabinet->process(block.getSubsetChannelBlock(0, juce::jmin(block.getNumChannels(), cabinet->getNumChannels())));
+        
+        // with no response loaded the stage passes its input straight through, silence included
+        if( cabinet->isActive() )
+            inputGateSilent = false;
+    }
+    else if constexpr (Position == ChainPositions::DistortedDelay)
+    {
+        auto stereoBlock = block.getSubsetChannelBlock(0, juce::jmin(block.getNumChannels(), (size_t) 2));
+        juce::dsp::ProcessContextReplacing<SampleType> stereoContext(stereoBlock);
+        
+        // a shut gate upstream means there's nothing to write into the line but its feedback
+        chains.delay.process(stereoContext, getModulation(Modulation_DelayTime, startSample), inputGateSilent);
+        inputGateSilent = false;
+    }
+    else
+    {
+        // Silence in is silence out of every curve, so a shut gate saves the whole distortion.
+        // Its state is still brought to where the silence would have left it, so the first
+        // block after the gate opens doesn't start from a stale input or gain.
+        if constexpr (Position == ChainPositions::WaveshapingDistortion)
+        {
+            if( inputGateSilent )
+            {
+                std::array<MonoChain<SampleType>*, 2> monoChains { &chains.left, &chains.right };
+                
+                for( size_t ch = 0; ch < juce::jmin(block.getNumChannels(), monoChains.size()); ++ch )
+                {
+                    auto channelBlock = block.getSingleChannelBlock(ch);
+                    juce::dsp::ProcessContextReplacing<SampleType> context(channelBlock);
+                    
+                    // the crossovers and allpasses would have rung down to nothing
+                    if( chains.multibandDistortions[ch].getNumBands() > 1 )
+                        chains.multibandDistortions[ch].reset();
+                    else
+                        monoChains[ch]->template get<Position>().template get<0>().skipSilence(context);
+                }
+                
+                return;
+            }
+        }
+        
+        // the cut filters can still be ringing out
+        if constexpr (Position != ChainPositions::WaveshapingDistortion)
+            inputGateSilent = false;
+        
+        if constexpr (Position != ChainPositions::WaveshapingDistortion)
+        {
+            if( cutFilterEngine == CutFilterEngine::CutFilterEngine_LinearPhase )
+            {
+                // one kernel holds both cuts, so it runs in the low cut's place and the high cut passes
+                if( Position == ChainPositions::LowCut )
+                    linearPhaseFilter->process(block);
+                
+                return;
+            }
+            
+            if constexpr (std::is_same_v<SampleType, float>)
+            {
+                if( doublePrecisionFilters )
+                {
+                    runStageInDoublePrecision<Position>(block, startSample);
+                    return;
+                }
+            }
+            
+            if( cutFilterEngine == CutFilterEngine::CutFilterEngine_Svf )
+            {
+                auto& svfs = Position == ChainPositions::LowCut ? chains.lowCutSvfs : chains.highCutSvfs;
+                auto* cutoffModulation = getModulation(Position == ChainPositions::LowCut ? Modulation_LowCut : Modulation_HighCut, startSample);
+                
+                for( size_t ch = 0; ch < juce::jmin(block.getNumChannels(), svfs.size()); ++ch )
+                {
+                    auto channelBlock = block.getSingleChannelBlock(ch);
+                    juce::dsp::ProcessContextReplacing<SampleType> context(channelBlock);
+                    
+                    svfs[ch].process(context, cutoffModulation);
+                }
+                
+                return;
+            }
+        }
+        
+        std::array<MonoChain<SampleType>*, 2> monoChains { &chains.left, &chains.right };
+        
+        // the modulated parts of the distortion gains are applied around the waveshaper
+        const float* driveModulation = nullptr;
+        const float* postGainModulation = nullptr;
+        
+        if constexpr (Position == ChainPositions::WaveshapingDistortion)
+        {
+            driveModulation = getModulation(Modulation_DistortionGain, startSample);
+            postGainModulation = getModulation(Modulation_DistortionPostGain, startSample);
+        }
+        
+        auto applyGains = [&block](size_t ch, const float* gains)
+        {
+            auto* data = block.getChannelPointer(ch);
+            
+            for( size_t i = 0; i < block.getNumSamples(); ++i )
+                data[i] *= (SampleType) gains[i];
+        };
+        
+        for( size_t ch = 0; ch < juce::jmin(block.getNumChannels(), monoChains.size()); ++ch )
+        {
+            if( driveModulation != nullptr )
+                applyGains(ch, driveModulation);
+            
+            auto channelBlock = block.getSingleChannelBlock(ch);
+            juce::dsp::ProcessContextReplacing<SampleType> context(channelBlock);
+            
+            if( Position == ChainPositions::WaveshapingDistortion && chains.multibandDistortions[ch].getNumBands() > 1 )
+                chains.multibandDistortions[ch].process(context);
+            else
+                monoChains[ch]->template get<Position>().process(context);
+            
+            if( postGainModulation != nullptr )
+                applyGains(ch, postGainModulation);
+        }
+    }
+}
 
-    juce::dsp::ProcessContextReplacing<float> leftContext(leftBlock);
-    juce::dsp::ProcessContextReplacing<float> rightContext(rightBlock);
+template<int Position>
+void FilterPedalAudioProcessor::runStageInDoublePrecision(juce::dsp::AudioBlock<float>& block, size_t startSample)
+{
+    // The mixed mode: the cut filters keep their state and coefficients in double, so
+    // steep, low cutoffs at high sample rates don't drown in rounding noise, while the
+    // rest of the float chain stays in float.
+    auto numChannels = juce::jmin(block.getNumChannels(), (size_t) mixedPrecisionBuffer.getNumChannels());
+    auto maxChunkSize = (size_t) mixedPrecisionBuffer.getNumSamples();
+    
+    for( size_t start = 0; start < block.getNumSamples() && maxChunkSize > 0; start += maxChunkSize )
+    {
+        auto chunk = block.getSubBlock(start, juce::jmin(maxChunkSize, block.getNumSamples() - start));
+        auto numSamples = chunk.getNumSamples();
+        
+        for( size_t ch = 0; ch < numChannels; ++ch )
+            std::copy(chunk.getChannelPointer(ch), chunk.getChannelPointer(ch) + numSamples,
+                      mixedPrecisionBuffer.getWritePointer((int) ch));
+        
+        juce::dsp::AudioBlock<double> doubleBlock(mixedPrecisionBuffer.getArrayOfWritePointers(), numChannels, numSamples);
+        runStage<Position>(doubleBlock, startSample + start);
+        
+        for( size_t ch = 0; ch < numChannels; ++ch )
+            std::transform(mixedPrecisionBuffer.getReadPointer((int) ch), mixedPrecisionBuffer.getReadPointer((int) ch) + numSamples,
+                           chunk.getChannelPointer(ch), [](double x) { return static_cast<float>(x); });
+    }
+}
 
-    leftChain.process(leftContext);
-    rightChain.process(rightContext);
+template<typename SampleType>
+void FilterPedalAudioProcessor::processChain(const ChainSettings& chainSettings, juce::dsp::AudioBlock<SampleType>& block)
+{
+    static constexpr auto chainOrderProcessors = makeChainOrderProcessors<SampleType>(std::make_index_sequence<chainOrders.size()>());
+    
+    auto requestedOrder = juce::jmin(chainSettings.chainOrder, chainOrders.size() - 1);
+    auto numSamples = block.getNumSamples();
+    auto fadeLength = chainOrderFadeSamples;
+    
+    // The orders share their stages, so two of them can't run side by side to be crossfaded.
+    // Instead the old order fades out and the new one fades in, each over a fixed time
+    // however short the host's blocks are, with the fade carried on from block to block.
+    size_t start = 0;
+    
+    while( start < numSamples )
+    {
+        if( requestedOrder != activeChainOrder )
+        {
+            if( chainOrderFadePosition < 0 )
+                chainOrderFadePosition = 0;
+            else if( chainOrderFadePosition > fadeLength )
+                chainOrderFadePosition = 2 * fadeLength - chainOrderFadePosition;   // turn back from the same gain
+            else if( chainOrderFadePosition == fadeLength )
+                activeChainOrder = requestedOrder;
+        }
+        
+        if( chainOrderFadePosition < 0 )
+        {
+            auto rest = block.getSubBlock(start);
+            (this->*chainOrderProcessors[activeChainOrder])(rest, start);
+            return;
+        }
+        
+        auto fadingIn = chainOrderFadePosition >= fadeLength;
+        auto end = fadingIn ? 2 * fadeLength : fadeLength;
+        auto length = juce::jmin(numSamples - start, (size_t) (end - chainOrderFadePosition));
+        
+        auto segment = block.getSubBlock(start, length);
+        (this->*chainOrderProcessors[activeChainOrder])(segment, start);
+        
+        auto gainAt = [fadingIn, fadeLength](int position)
+        {
+            return fadingIn ? (SampleType) (position - fadeLength) / (SampleType) fadeLength
+                            : SampleType (1) - (SampleType) position / (SampleType) fadeLength;
+        };
+        
+        applyGainRamp(segment, gainAt(chainOrderFadePosition), gainAt(chainOrderFadePosition + (int) length));
+        
+        chainOrderFadePosition += (int) length;
+        
+        if( chainOrderFadePosition >= 2 * fadeLength )
+            chainOrderFadePosition = -1;
+        
+        start += length;
+    }
 }
 
 //==============================================================================
@@ -203,7 +707,9 @@ void FilterPedalAudioProcessor::setStateInformation (const void* data, int sizeI
     if( tree.isValid() )
     {
         apvts.replaceState(tree);
-        updateComponents();
+        filterDesignsChanged = true;
+        
+        updateCabinet();
     }
 }
 
@@ -217,6 +723,23 @@ ChainSettings getChainSettings(juce::AudioProcessorValueTreeState& apvts)
     settings.highCutSlope = static_cast<Slope>(apvts.getRawParameterValue("HighCut Slope")->load());
     settings.distortionPreGainInDecibels = apvts.getRawParameterValue("Distortion Amount")->load();
     settings.distortionPostGainInDecibels = apvts.getRawParameterValue("Distortion PostGain")->load();
+    settings.distortionCurve = static_cast<AdaaWaveShaper<float>::Curve>(apvts.getRawParameterValue("Distortion Curve")->load());
+    settings.distortionBands = static_cast<size_t>(apvts.getRawParameterValue("Distortion Bands")->load()) + 1;
+    settings.distortionAutoGain = static_cast<Distortion<float>::AutoGain>(apvts.getRawParameterValue("Distortion Auto Gain")->load());
+    
+    static constexpr const char* crossoverIds[] { "Crossover 1", "Crossover 2", "Crossover 3" };
+    static constexpr const char* bandDriveIds[] { "Band 1 Drive", "Band 2 Drive", "Band 3 Drive", "Band 4 Drive" };
+    static constexpr const char* bandPostGainIds[] { "Band 1 PostGain", "Band 2 PostGain", "Band 3 PostGain", "Band 4 PostGain" };
+    
+    for( size_t i = 0; i < settings.crossoverFreqs.size(); ++i )
+        settings.crossoverFreqs[i] = apvts.getRawParameterValue(crossoverIds[i])->load();
+    
+    for( size_t i = 0; i < settings.bandDrives.size(); ++i )
+    {
+        settings.bandDrives[i] = apvts.getRawParameterValue(bandDriveIds[i])->load();
+        settings.bandPostGains[i] = apvts.getRawParameterValue(bandPostGainIds[i])->load();
+    }
+    
     settings.delayDry = apvts.getRawParameterValue("Delay Dry")->load();
     settings.delayWet = apvts.getRawParameterValue("Delay Wet")->load();
     settings.delayFeedback = apvts.getRawParameterValue("Delay Feedback")->load();
@@ -226,88 +749,793 @@ ChainSettings getChainSettings(juce::AudioProcessorValueTreeState& apvts)
     settings.delayHighCutFreq = apvts.getRawParameterValue("Delay HighCut")->load();
     settings.delayDistortionPreGain = apvts.getRawParameterValue("Delay Distortion")->load();
     settings.delayDistortionPostGain = apvts.getRawParameterValue("Delay PostGain")->load();
+    settings.delayRouting = static_cast<DelayRouting>(apvts.getRawParameterValue("Delay Routing")->load());
+    settings.delayPlayback = static_cast<DelayPlayback>(apvts.getRawParameterValue("Delay Playback")->load());
+    settings.delayCrossFeed = apvts.getRawParameterValue("Delay CrossFeed")->load();
+    settings.delayDiffusion = apvts.getRawParameterValue("Delay Diffusion")->load();
+    settings.delayDiffusionDecay = apvts.getRawParameterValue("Delay Diffusion Decay")->load();
+    settings.delayDuckThreshold = apvts.getRawParameterValue("Delay Duck Threshold")->load();
+    settings.delayDuckDepth = apvts.getRawParameterValue("Delay Duck Depth")->load();
+    settings.delayDuckRelease = apvts.getRawParameterValue("Delay Duck Release")->load();
+    settings.delayPitchShift = apvts.getRawParameterValue("Delay Pitch Shift")->load();
+    settings.delayRunaway = apvts.getRawParameterValue("Delay Runaway")->load();
+    settings.delayFeedbackThreshold = apvts.getRawParameterValue("Delay Feedback Threshold")->load();
+    settings.delayTaps = static_cast<size_t>(apvts.getRawParameterValue("Delay Taps")->load());
+    
+    static constexpr const char* tapTimeIds[] { "Tap 1 Time", "Tap 2 Time", "Tap 3 Time", "Tap 4 Time", "Tap 5 Time", "Tap 6 Time", "Tap 7 Time", "Tap 8 Time" };
+    static constexpr const char* tapLevelIds[] { "Tap 1 Level", "Tap 2 Level", "Tap 3 Level", "Tap 4 Level", "Tap 5 Level", "Tap 6 Level", "Tap 7 Level", "Tap 8 Level" };
+    static constexpr const char* tapPanIds[] { "Tap 1 Pan", "Tap 2 Pan", "Tap 3 Pan", "Tap 4 Pan", "Tap 5 Pan", "Tap 6 Pan", "Tap 7 Pan", "Tap 8 Pan" };
+    static constexpr const char* tapHighCutIds[] { "Tap 1 HighCut", "Tap 2 HighCut", "Tap 3 HighCut", "Tap 4 HighCut", "Tap 5 HighCut", "Tap 6 HighCut", "Tap 7 HighCut", "Tap 8 HighCut" };
+    
+    for( size_t i = 0; i < settings.delayTapSettings.size(); ++i )
+    {
+        settings.delayTapSettings[i].time = apvts.getRawParameterValue(tapTimeIds[i])->load();
+        settings.delayTapSettings[i].level = apvts.getRawParameterValue(tapLevelIds[i])->load();
+        settings.delayTapSettings[i].pan = apvts.getRawParameterValue(tapPanIds[i])->load();
+        settings.delayTapSettings[i].highCut = apvts.getRawParameterValue(tapHighCutIds[i])->load();
+    }
+
+    settings.delayWidth = apvts.getRawParameterValue("Delay Width")->load();
+    
+    settings.gateThreshold = apvts.getRawParameterValue("Gate Threshold")->load();
+    settings.gateHysteresis = apvts.getRawParameterValue("Gate Hysteresis")->load();
+    settings.gateHold = apvts.getRawParameterValue("Gate Hold")->load();
+    settings.gateRelease = apvts.getRawParameterValue("Gate Release")->load();
+    settings.gateLookahead = apvts.getRawParameterValue("Gate Lookahead")->load();
     
     settings.lowCutBypassed = apvts.getRawParameterValue("LowCut Bypassed")->load() > 0.5f;
     settings.highCutBypassed = apvts.getRawParameterValue("HighCut Bypassed")->load() > 0.5f;
     settings.distortionBypassed = apvts.getRawParameterValue("Distortion Bypassed")->load() > 0.5f;
     settings.delayBypassed = apvts.getRawParameterValue("Delay Bypassed")->load() > 0.5f;
+    settings.cabinetBypassed = apvts.getRawParameterValue("Cab Bypassed")->load() > 0.5f;
+    settings.gateBypassed = apvts.getRawParameterValue("Gate Bypassed")->load() > 0.5f;
+    settings.limiterBypassed = apvts.getRawParameterValue("Limiter Bypassed")->load() > 0.5f;
+    settings.limiterCeiling = apvts.getRawParameterValue("Limiter Ceiling")->load();
+    settings.limiterRelease = apvts.getRawParameterValue("Limiter Release")->load();
+    settings.looperMode = static_cast<Looper::Mode>(apvts.getRawParameterValue("Looper")->load());
+    settings.looperUndo = apvts.getRawParameterValue("Looper Undo")->load() > 0.5f;
+    settings.delayBypassMode = static_cast<DelayBypassMode>(apvts.getRawParameterValue("Delay Bypass Mode")->load());
+    
+    settings.chainOrder = static_cast<size_t>(apvts.getRawParameterValue("Chain Order")->load());
+    settings.doublePrecisionFilters = apvts.getRawParameterValue("Filter Precision")->load() > 0.5f;
+    settings.cutFilterEngine = static_cast<CutFilterEngine>(apvts.getRawParameterValue("Cut Filter Engine")->load());
+    
+    settings.envelopeSource = static_cast<EnvelopeSource>(apvts.getRawParameterValue("Envelope Source")->load());
+    settings.envelopeRms = apvts.getRawParameterValue("Envelope Detector")->load() > 0.5f;
+    settings.envelopeAttack = apvts.getRawParameterValue("Envelope Attack")->load();
+    settings.envelopeRelease = apvts.getRawParameterValue("Envelope Release")->load();
+    settings.envelopeSensitivity = apvts.getRawParameterValue("Envelope Sensitivity")->load();
+    settings.envelopeToLowCut = apvts.getRawParameterValue("Envelope To LowCut")->load();
+    settings.envelopeToHighCut = apvts.getRawParameterValue("Envelope To HighCut")->load();
+    settings.envelopeToDistortion = apvts.getRawParameterValue("Envelope To Distortion")->load();
+    
+    static constexpr const char* lfoShapeIds[] { "LFO 1 Shape", "LFO 2 Shape" };
+    static constexpr const char* lfoRateIds[] { "LFO 1 Rate", "LFO 2 Rate" };
+    static constexpr const char* lfoSyncIds[] { "LFO 1 Sync", "LFO 2 Sync" };
+    
+    for( size_t i = 0; i < numLfos; ++i )
+    {
+        settings.lfos[i].shape = static_cast<Lfo<float>::Shape>(apvts.getRawParameterValue(lfoShapeIds[i])->load());
+        settings.lfos[i].rate = apvts.getRawParameterValue(lfoRateIds[i])->load();
+        settings.lfos[i].sync = static_cast<size_t>(apvts.getRawParameterValue(lfoSyncIds[i])->load());
+    }
+    
+    static constexpr const char* slotSourceIds[] { "Mod 1 Source", "Mod 2 Source", "Mod 3 Source", "Mod 4 Source" };
+    static constexpr const char* slotDestinationIds[] { "Mod 1 Destination", "Mod 2 Destination", "Mod 3 Destination", "Mod 4 Destination" };
+    static constexpr const char* slotAmountIds[] { "Mod 1 Amount", "Mod 2 Amount", "Mod 3 Amount", "Mod 4 Amount" };
+    
+    for( size_t i = 0; i < numModulationSlots; ++i )
+    {
+        settings.modulationSlots[i].source = static_cast<ModulationSource>(apvts.getRawParameterValue(slotSourceIds[i])->load());
+        settings.modulationSlots[i].destination = static_cast<ModulationDestination>(apvts.getRawParameterValue(slotDestinationIds[i])->load());
+        settings.modulationSlots[i].amount = apvts.getRawParameterValue(slotAmountIds[i])->load();
+    }
 
     return settings;
 }
 
-void updateCoefficients(Coefficients &old, const Coefficients &replacements)
+CutFilterEngine ChainSettings::getActiveCutFilterEngine() const noexcept
+{
+    // biquads can't follow a per-sample cutoff, and neither can a designed FIR,
+    // so modulated cut filters always use the state variable engine
+    return modulatesCutoffs() ? CutFilterEngine::CutFilterEngine_Svf : cutFilterEngine;
+}
+
+bool ChainSettings::modulatesCutoffs() const noexcept
+{
+    if( envelopeToLowCut != 0.f || envelopeToHighCut != 0.f )
+        return true;
+    
+    return std::any_of(modulationSlots.begin(), modulationSlots.end(), [](const ModulationSlot& slot)
+    {
+        return slot.source != ModulationSource_None && slot.amount != 0.f
+            && (slot.destination == Modulation_LowCut || slot.destination == Modulation_HighCut);
+    });
+}
+
+FilterDesigns designFilters(const ChainSettings& chainSettings, double sampleRate, SharedDspResources& resources)
+{
+    auto makeCutFilterDesign = [](const auto& coefficients, Slope slope)
+    {
+        CutFilterDesign design;
+        design.numStages = juce::jmin(static_cast<size_t>(slope) + 1, design.stages.size());
+        
+        for( size_t i = 0; i < design.numStages; ++i )
+        {
+            auto* raw = coefficients[(int) i]->getRawCoefficients();
+            std::copy(raw, raw + design.stages[i].size(), design.stages[i].begin());
+        }
+        
+        return design;
+    };
+    
+    // every instance running at the same rate with the same settings shares one design
+    FilterDesigns designs;
+    
+    designs.sampleRate = sampleRate;
+    
+    designs.lowCutEntry = resources.getCutFilterDesign({ "LowCut", sampleRate, chainSettings.lowCutFreq, chainSettings.lowCutSlope }, [&]
+    {
+        return makeCutFilterDesign(makeLowCutFilter(chainSettings, sampleRate), chainSettings.lowCutSlope);
+    });
+    
+    designs.highCutEntry = resources.getCutFilterDesign({ "HighCut", sampleRate, chainSettings.highCutFreq, chainSettings.highCutSlope }, [&]
+    {
+        return makeCutFilterDesign(makeHighCutFilter(chainSettings, sampleRate), chainSettings.highCutSlope);
+    });
+    
+    designs.lowCut = *designs.lowCutEntry;
+    designs.highCut = *designs.highCutEntry;
+    
+    designs.lowCut.bypassed = chainSettings.lowCutBypassed;
+    designs.highCut.bypassed = chainSettings.highCutBypassed;
+    
+    return designs;
+}
+
+void FilterPedalAudioProcessor::publishFilterDesigns(const ChainSettings& chainSettings)
+{
+    auto designs = designFilters(chainSettings, getSampleRate() > 0 ? getSampleRate() : 44100.0, *sharedResources);
+    
+    filterDesigns.write(designs);
+    
+    if( chainSettings.getActiveCutFilterEngine() == CutFilterEngine::CutFilterEngine_LinearPhase && designs != linearPhaseDesigns )
+    {
+        linearPhaseDesigns = designs;
+        designLinearPhaseKernel(designs, true);
+    }
+    
+    updateLatency(chainSettings);
+    
+    auto& model = responseModels.getWriteBuffer();
+    
+    model.sampleRate = designs.sampleRate;
+    model.lowCut = designs.lowCut;
+    model.highCut = designs.highCut;
+    model.distortionPreGain = chainSettings.distortionPreGainInDecibels;
+    model.distortionPostGain = chainSettings.distortionPostGainInDecibels;
+    model.distortionBypassed = chainSettings.distortionBypassed;
+    
+    responseModels.publish();
+}
+
+void FilterPedalAudioProcessor::applyFilterDesigns(const FilterDesigns& designs)
+{
+    // both precisions get the coefficients, so the mixed mode can be switched at any time
+    updateCutFilter(floatChains.left.get<ChainPositions::LowCut>(), designs.lowCut);
+    updateCutFilter(floatChains.right.get<ChainPositions::LowCut>(), designs.lowCut);
+    updateCutFilter(doubleChains.left.get<ChainPositions::LowCut>(), designs.lowCut);
+    updateCutFilter(doubleChains.right.get<ChainPositions::LowCut>(), designs.lowCut);
+    
+    updateCutFilter(floatChains.left.get<ChainPositions::HighCut>(), designs.highCut);
+    updateCutFilter(floatChains.right.get<ChainPositions::HighCut>(), designs.highCut);
+    updateCutFilter(doubleChains.left.get<ChainPositions::HighCut>(), designs.highCut);
+    updateCutFilter(doubleChains.right.get<ChainPositions::HighCut>(), designs.highCut);
+}
+
+void FilterPedalAudioProcessor::designLinearPhaseKernel(const FilterDesigns& designs, bool inBackground)
+{
+    ResponseModel model;
+    model.sampleRate = designs.sampleRate;
+    model.lowCut = designs.lowCut;
+    model.highCut = designs.highCut;
+    
+    // the job only holds on to the filter weakly, and skips itself if a newer design was asked for since
+    auto design = [filter = std::weak_ptr<LinearPhaseFilter>(linearPhaseFilter), model, ticket = linearPhaseFilter->requestDesign()]
+    {
+        if( auto lockedFilter = filter.lock() )
+            lockedFilter->design([&model](double frequency) { return model.getMagnitudeForFrequency(frequency); },
+                                 model.sampleRate,
+                                 ticket);
+    };
+    
+    if( inBackground )
+        sharedResources->runInBackground(design);
+    else
+        design();
+}
+
+void FilterPedalAudioProcessor::loadCabinetImpulseResponse(const juce::File& file)
+{
+    apvts.state.setProperty(cabinetFileProperty, file.getFullPathName(), nullptr);
+    updateCabinet();
+}
+
+juce::File FilterPedalAudioProcessor::getCabinetImpulseResponseFile() const
+{
+    auto path = apvts.state.getProperty(cabinetFileProperty).toString();
+    return path.isNotEmpty() ? juce::File(path) : juce::File();
+}
+
+void FilterPedalAudioProcessor::updateCabinet()
+{
+    auto sampleRate = getSampleRate();
+    
+    // prepareToPlay() calls this again once the rate is known
+    if( sampleRate <= 0 )
+        return;
+    
+    auto path = apvts.state.getProperty(cabinetFileProperty).toString();
+    
+    // reading, resampling and transforming the response all happen on the background thread
+    sharedResources->runInBackground([stage = std::weak_ptr<ImpulseResponseStage>(cabinet),
+                                      ticket = cabinet->requestLoad(),
+                                      numChannels = cabinet->getNumChannels(),
+                                      tailWorker = &sharedResources->getConvolutionTailWorker(),
+                                      path,
+                                      sampleRate]
+    {
+        std::unique_ptr<NonUniformConvolver> convolver;
+        
+        if( path.isNotEmpty() )
+        {
+            auto impulse = ImpulseResponseStage::loadImpulseResponse(juce::File(path), sampleRate);
+            
+            if( impulse.getNumSamples() > 0 )
+                convolver = std::make_unique<NonUniformConvolver>(impulse, numChannels, *tailWorker);
+        }
+        
+        if( auto lockedStage = stage.lock() )
+            lockedStage->setConvolver(std::move(convolver), ticket);
+    });
+}
+
+void FilterPedalAudioProcessor::updateLooper(const ChainSettings& chainSettings)
+{
+    if( chainSettings.looperUndo && ! looperUndoHeld )
+        looper.undo();
+
+    looperUndoHeld = chainSettings.looperUndo;
+
+    // an undo leaves an overdub playing, so the mode is only followed when it changes
+    if( chainSettings.looperMode != looperModeRequested )
+    {
+        looperModeRequested = chainSettings.looperMode;
+        looper.setMode(looperModeRequested);
+    }
+}
+
+void FilterPedalAudioProcessor::updateLatency(const ChainSettings& chainSettings)
 {
-    *old = *replacements;
+    auto latency = chainSettings.getActiveCutFilterEngine() == CutFilterEngine::CutFilterEngine_LinearPhase
+                 ? linearPhaseFilter->getLatencySamples()
+                 : 0;
+    
+    // the gate's lookahead delays the signal whether or not it's gating, so it only goes with the parameter
+    latency += NoiseGate<float>::getLookaheadSamples(chainSettings.gateLookahead, getSampleRate());
+    
+    if( ! chainSettings.limiterBypassed )
+        latency += TruePeakLimiter<float>::getLatencySamples(getSampleRate());
+    
+    if( latency != getLatencySamples() )
+        setLatencySamples(latency);
+    
+    // only now that the host knows can the audio thread switch to what it was worked out from
+    reportedLinearPhase = chainSettings.getActiveCutFilterEngine() == CutFilterEngine::CutFilterEngine_LinearPhase;
+    reportedLimiter = ! chainSettings.limiterBypassed;
+    reportedGateLookahead = chainSettings.gateLookahead;
 }
 
-void FilterPedalAudioProcessor::updateLowCutFilters(const ChainSettings &chainSettings)
+void FilterPedalAudioProcessor::followReportedLatency(ChainSettings& chainSettings) const
 {
-    auto lowCutCoefficients = makeLowCutFilter(chainSettings, getSampleRate());
+    // offline renders can't wait on the message thread, and the host has its latency before they start
+    if( isNonRealtime() )
+        return;
+    
+    chainSettings.limiterBypassed = ! reportedLimiter.load();
+    chainSettings.gateLookahead = reportedGateLookahead.load();
+}
 
-    auto& leftLowCut = leftChain.get<ChainPositions::LowCut>();
-    auto& rightLowCut = rightChain.get<ChainPositions::LowCut>();
+template<int Position>
+void FilterPedalAudioProcessor::resetCutFilter()
+{
+    auto resetChains = [](auto& chains)
+    {
+        chains.left.template get<Position>().reset();
+        chains.right.template get<Position>().reset();
+        
+        for( auto& svf : Position == ChainPositions::LowCut ? chains.lowCutSvfs : chains.highCutSvfs )
+            svf.reset();
+    };
     
-    leftChain.setBypassed<ChainPositions::LowCut>(chainSettings.lowCutBypassed);
-    rightChain.setBypassed<ChainPositions::LowCut>(chainSettings.lowCutBypassed);
+    resetChains(floatChains);
+    resetChains(doubleChains);
     
-    updateCutFilter(leftLowCut, lowCutCoefficients, chainSettings.lowCutSlope);
-    updateCutFilter(rightLowCut, lowCutCoefficients, chainSettings.lowCutSlope);
+    // the linear phase kernel holds both cuts and runs in the low cut's place
+    if constexpr (Position == ChainPositions::LowCut)
+        linearPhaseFilter->reset();
 }
 
-void FilterPedalAudioProcessor::updateHighCutFilters(const ChainSettings &chainSettings)
+void FilterPedalAudioProcessor::updateCutFilters(const ChainSettings &chainSettings)
 {
-    auto highCutCoefficients = makeHighCutFilter(chainSettings, getSampleRate());
+    // The filters are designed on the message thread whenever a parameter changes; here we
+    // just pick up the newest complete set. Offline renders can't rely on the message thread
+    // keeping up with automation, so they design in place.
+    if( isNonRealtime() )
+    {
+        auto designs = designFilters(chainSettings, getSampleRate(), *sharedResources);
+        applyFilterDesigns(designs);
+        
+        if( cutFilterEngine == CutFilterEngine::CutFilterEngine_LinearPhase && designs != offlineLinearPhaseDesigns )
+        {
+            offlineLinearPhaseDesigns = designs;
+            designLinearPhaseKernel(designs, false);
+        }
+    }
+    else if( auto* designs = filterDesigns.acquire() )
+        applyFilterDesigns(*designs);
     
-    auto& leftHighCut = leftChain.get<ChainPositions::HighCut>();
-    auto& rightHighCut = rightChain.get<ChainPositions::HighCut>();
+    // the state variable filters take the cutoffs directly, with no design step
+    if( cutFilterEngine == CutFilterEngine::CutFilterEngine_Svf )
+    {
+        auto updateSvfs = [&chainSettings](auto& chains)
+        {
+            for( auto& svf : chains.lowCutSvfs )
+            {
+                svf.setNumSections(static_cast<size_t>(chainSettings.lowCutSlope) + 1);
+                svf.setCutoffFrequency(chainSettings.lowCutFreq);
+            }
+            
+            for( auto& svf : chains.highCutSvfs )
+            {
+                svf.setNumSections(static_cast<size_t>(chainSettings.highCutSlope) + 1);
+                svf.setCutoffFrequency(chainSettings.highCutFreq);
+            }
+        };
+        
+        updateSvfs(floatChains);
+        updateSvfs(doubleChains);
+    }
     
-    leftChain.setBypassed<ChainPositions::HighCut>(chainSettings.highCutBypassed);
-    rightChain.setBypassed<ChainPositions::HighCut>(chainSettings.highCutBypassed);
+    // the linear phase kernel applies the bypasses itself, and keeps running so the latency stays put
+    auto linearPhase = cutFilterEngine == CutFilterEngine::CutFilterEngine_LinearPhase;
     
-    updateCutFilter(leftHighCut, highCutCoefficients, chainSettings.highCutSlope);
-    updateCutFilter(rightHighCut, highCutCoefficients, chainSettings.highCutSlope);
+    setStageEnabled(ChainPositions::LowCut, linearPhase || ! chainSettings.lowCutBypassed);
+    setStageEnabled(ChainPositions::HighCut, ! linearPhase && ! chainSettings.highCutBypassed);
 }
 
+template<typename SampleType>
 void FilterPedalAudioProcessor::updateDistortion(const ChainSettings &chainSettings)
 {
-    auto& leftDistortion = leftChain.get<ChainPositions::WaveshapingDistortion>();
-    auto& rightDistortion = rightChain.get<ChainPositions::WaveshapingDistortion>();
+    auto& chains = getChains<SampleType>();
+    auto& leftDistortion = chains.left.template get<ChainPositions::WaveshapingDistortion>();
+    auto& rightDistortion = chains.right.template get<ChainPositions::WaveshapingDistortion>();
 
-    leftChain.setBypassed<ChainPositions::WaveshapingDistortion>(chainSettings.distortionBypassed);
-    rightChain.setBypassed<ChainPositions::WaveshapingDistortion>(chainSettings.distortionBypassed);
+    setStageEnabled(ChainPositions::WaveshapingDistortion, ! chainSettings.distortionBypassed);
+    setStageEnabled(ChainPositions::CabinetSimulator, ! chainSettings.cabinetBypassed);
 
     updateDistortionGain(leftDistortion, chainSettings);
     updateDistortionGain(rightDistortion, chainSettings);
+    
+    for( auto* distortion : { &leftDistortion, &rightDistortion } )
+    {
+        distortion->template get<0>().setCurve(static_cast<typename Distortion<SampleType>::Curve>(chainSettings.distortionCurve));
+        distortion->template get<0>().setAutoGain(static_cast<typename Distortion<SampleType>::AutoGain>(chainSettings.distortionAutoGain));
+    }
+    
+    for( auto& distortion : chains.multibandDistortions )
+    {
+        // the crossovers' state belongs to the old split
+        if( distortion.getNumBands() != chainSettings.distortionBands )
+        {
+            distortion.setNumBands(chainSettings.distortionBands);
+            distortion.reset();
+        }
+        
+        for( size_t i = 0; i < chainSettings.crossoverFreqs.size(); ++i )
+            distortion.setCrossoverFrequency(i, (SampleType) chainSettings.crossoverFreqs[i]);
+        
+        distortion.setCurve(static_cast<typename MultibandDistortion<SampleType>::Curve>(chainSettings.distortionCurve));
+        
+        for( size_t band = 0; band < chainSettings.bandDrives.size(); ++band )
+        {
+            auto drive = chainSettings.distortionPreGainInDecibels + chainSettings.bandDrives[band];
+            
+            // the bands get the curve's static compensation in either auto gain mode
+            auto compensation = chainSettings.distortionAutoGain != Distortion<float>::autoGainOff
+                              ? Distortion<float>::getStaticCompensation(chainSettings.distortionCurve, drive)
+                              : 0.f;
+            
+            distortion.setBandGains(band,
+                                    (SampleType) drive,
+                                    (SampleType) (chainSettings.distortionPostGainInDecibels + chainSettings.bandPostGains[band] + compensation));
+        }
+    }
 }
 
+template<typename SampleType>
 void FilterPedalAudioProcessor::updateDelay(const ChainSettings &chainSettings)
 {
-    auto& leftDelay = leftChain.get<ChainPositions::DistortedDelay>();
-    auto& rightDelay = rightChain.get<ChainPositions::DistortedDelay>();
+    delayBypassMode = chainSettings.delayBypassMode;
     
-    leftChain.setBypassed<ChainPositions::DistortedDelay>(chainSettings.delayBypassed);
-    rightChain.setBypassed<ChainPositions::DistortedDelay>(chainSettings.delayBypassed);
+    setStageEnabled(ChainPositions::DistortedDelay, ! chainSettings.delayBypassed);
     
-    if (chainSettings.delayBypassed == 1)
+    updateDelayValues(getChains<SampleType>().delay, chainSettings);
+}
+
+void FilterPedalAudioProcessor::setStageEnabled(int position, bool shouldBeEnabled)
+{
+    auto& mix = stageMixes[(size_t) position];
+    auto target = shouldBeEnabled ? 1.f : 0.f;
+    
+    if( mix.getTargetValue() == target )
+        return;
+    
+    // the filters haven't run while bypassed, so don't fade them back in from stale state
+    if( shouldBeEnabled && mix.getCurrentValue() == 0.f )
     {
-        muteDelay(leftDelay, chainSettings);
-        muteDelay(rightDelay, chainSettings);
+        if( position == ChainPositions::LowCut )
+            resetCutFilter<ChainPositions::LowCut>();
+        else if( position == ChainPositions::HighCut )
+            resetCutFilter<ChainPositions::HighCut>();
     }
-    else
+    
+    mix.setTargetValue(target);
+}
+
+template<typename SampleType>
+void FilterPedalAudioProcessor::updateComponents(const ChainSettings& chainSettings)
+{
+    auto useDoublePrecisionFilters = std::is_same_v<SampleType, float> && chainSettings.doublePrecisionFilters;
+    
+    auto engine = chainSettings.getActiveCutFilterEngine();
+    
+    // a switch into or out of the linear phase engine waits until its latency has been reported
+    if( ! isNonRealtime() && (engine == CutFilterEngine::CutFilterEngine_LinearPhase) != reportedLinearPhase.load() )
+        engine = cutFilterEngine;
+    
+    auto cutFiltersSwitched = useDoublePrecisionFilters != doublePrecisionFilters
+                           || engine != cutFilterEngine;
+    auto latencySwitched = (engine == CutFilterEngine::CutFilterEngine_LinearPhase)
+                        != (cutFilterEngine == CutFilterEngine::CutFilterEngine_LinearPhase);
+    
+    doublePrecisionFilters = useDoublePrecisionFilters;
+    cutFilterEngine = engine;
+    
+    updateCutFilters(chainSettings);
+    
+    // The kernel's output lags its input by the latency, so fading the cut stages in or out
+    // against their dry input would comb filter. They cut over in the block the switch
+    // happens in, which is the first one the reported latency covers.
+    if( latencySwitched )
+    {
+        for( auto position : { ChainPositions::LowCut, ChainPositions::HighCut } )
+            stageMixes[(size_t) position].setCurrentAndTargetValue(stageMixes[(size_t) position].getTargetValue());
+    }
+    
+    // the filters switched to haven't been running, so start them from silence
+    if( cutFiltersSwitched )
     {
-        updateDelayValues(leftDelay, chainSettings, 0);
-        updateDelayValues(rightDelay, chainSettings, 1);
+        resetCutFilter<ChainPositions::LowCut>();
+        resetCutFilter<ChainPositions::HighCut>();
+    }
+    
+    updateDistortion<SampleType>(chainSettings);
+    updateDelay<SampleType>(chainSettings);
+    updateGate<SampleType>(chainSettings);
+    updateLimiter<SampleType>(chainSettings);
+}
+
+template<typename SampleType>
+void FilterPedalAudioProcessor::updateGate(const ChainSettings& chainSettings)
+{
+    auto& chains = getChains<SampleType>();
+    
+    // with lookahead the stage keeps running while bypassed, as a plain delay, so the latency stays put
+    setStageEnabled(ChainPositions::InputGate, ! chainSettings.gateBypassed || chainSettings.gateLookahead > 0.f);
+    
+    for( auto* chain : { &chains.left, &chains.right } )
+    {
+        auto& gate = chain->template get<monoChainGateIndex>();
+        
+        gate.setEnabled(! chainSettings.gateBypassed);
+        gate.setThreshold((SampleType) chainSettings.gateThreshold);
+        gate.setHysteresis((SampleType) chainSettings.gateHysteresis);
+        gate.setHoldTime((SampleType) chainSettings.gateHold);
+        gate.setReleaseTime((SampleType) chainSettings.gateRelease);
+        gate.setLookaheadTime((SampleType) chainSettings.gateLookahead);
     }
 }
 
-void FilterPedalAudioProcessor::updateComponents()
+template<typename SampleType>
+void FilterPedalAudioProcessor::updateLimiter(const ChainSettings& chainSettings)
 {
+    auto& chains = getChains<SampleType>();
+    auto& limiter = chains.limiter;
+    
+    // its lookahead still holds whatever it last let through, from before it was switched off
+    if( ! chainSettings.limiterBypassed && ! chains.limiterActive )
+        limiter.reset();
+    
+    chains.limiterActive = ! chainSettings.limiterBypassed;
+    
+    limiter.setCeiling((SampleType) chainSettings.limiterCeiling);
+    limiter.setReleaseTime((SampleType) chainSettings.limiterRelease);
+}
+
+template<typename SampleType>
+void FilterPedalAudioProcessor::updateModulation(const ChainSettings& chainSettings, juce::AudioBuffer<SampleType>& buffer)
+{
+    auto numSamples = buffer.getNumSamples();
+    
+    // work out which sources are needed and which destinations they reach this block
+    auto envelopeDepths = std::array<float, numModulationDestinations> { chainSettings.envelopeToLowCut,
+                                                                         chainSettings.envelopeToHighCut,
+                                                                         chainSettings.envelopeToDistortion,
+                                                                         0.f,
+                                                                         0.f };
+    
+    std::array<bool, numModulationSources> usedSources {};
+    
+    for( size_t destination = 0; destination < envelopeDepths.size(); ++destination )
+    {
+        activeModulations[destination] = envelopeDepths[destination] != 0.f;
+        usedSources[ModulationSource_Envelope] = usedSources[ModulationSource_Envelope] || activeModulations[destination];
+    }
+    
+    for( const auto& slot : chainSettings.modulationSlots )
+    {
+        if( slot.source != ModulationSource_None && slot.amount != 0.f )
+        {
+            usedSources[slot.source] = true;
+            activeModulations[slot.destination] = true;
+        }
+    }
+    
+    // a block longer than prepareToPlay announced goes unmodulated rather than allocate here
+    if( numSamples > modulationBuffer.getNumSamples() )
+        activeModulations.fill(false);
+    
+    if( std::none_of(activeModulations.begin(), activeModulations.end(), [](bool active) { return active; }) )
+        return;
+    
+    if( usedSources[ModulationSource_Envelope] )
+    {
+        auto& follower = getChains<SampleType>().envelopeFollower;
+        
+        follower.setDetector(chainSettings.envelopeRms ? EnvelopeFollower<SampleType>::rms : EnvelopeFollower<SampleType>::peak);
+        follower.setAttackTime(chainSettings.envelopeAttack);
+        follower.setReleaseTime(chainSettings.envelopeRelease);
+        
+        // the sidechain when it's asked for and connected, otherwise the main input
+        auto* sidechainBus = getBus(true, 1);
+        auto useSidechain = chainSettings.envelopeSource == EnvelopeSource::EnvelopeSource_Sidechain
+                         && sidechainBus != nullptr && sidechainBus->isEnabled();
+        
+        auto detectorBuffer = getBusBuffer(buffer, true, useSidechain ? 1 : 0);
+        juce::dsp::AudioBlock<SampleType> detectorBlock(detectorBuffer);
+        
+        auto* envelope = envelopeBuffer.getWritePointer(0);
+        
+        follower.process(detectorBlock, envelope);
+        
+        juce::FloatVectorOperations::multiply(envelope, juce::Decibels::decibelsToGain(chainSettings.envelopeSensitivity), numSamples);
+        juce::FloatVectorOperations::min(envelope, envelope, 1.f, numSamples);
+    }
+    
+    juce::Optional<double> bpm, ppqPosition;
+    auto isPlaying = false;
+    
+    if( auto* playHead = getPlayHead() )
+    {
+        if( auto position = playHead->getPosition() )
+        {
+            bpm = position->getBpm();
+            ppqPosition = position->getPpqPosition();
+            isPlaying = position->getIsPlaying();
+        }
+    }
+    
+    for( size_t i = 0; i < numLfos; ++i )
+    {
+        if( ! usedSources[ModulationSource_Lfo1 + i] )
+            continue;
+        
+        const auto& settings = chainSettings.lfos[i];
+        auto& lfo = lfos[i];
+        auto beatsPerCycle = lfoSyncBeats[juce::jmin(settings.sync, lfoSyncBeats.size() - 1)];
+        
+        lfo.setShape(settings.shape);
+        
+        // synced LFOs follow the host's tempo, and its position while it's playing; with no
+        // tempo from the host they run free at their own rate
+        if( beatsPerCycle > 0 && bpm.hasValue() )
+        {
+            lfo.setFrequency((float) (*bpm / (60.0 * beatsPerCycle)));
+            
+            if( isPlaying && ppqPosition.hasValue() )
+                lfo.setPhase((float) std::fmod(*ppqPosition / beatsPerCycle, 1.0));
+        }
+        else
+        {
+            lfo.setFrequency(settings.rate);
+        }
+        
+        lfo.render(lfoBuffer.getWritePointer((int) i), numSamples);
+    }
+    
+    auto getSource = [this](ModulationSource source) -> const float*
+    {
+        if( source == ModulationSource_Envelope )
+            return envelopeBuffer.getReadPointer(0);
+        
+        return lfoBuffer.getReadPointer(source - ModulationSource_Lfo1);
+    };
+    
+    // the matrix: every destination is the sum of its sources, scaled to its own range
+    for( size_t destination = 0; destination < activeModulations.size(); ++destination )
+    {
+        if( ! activeModulations[destination] )
+            continue;
+        
+        auto* modulation = modulationBuffer.getWritePointer((int) destination);
+        
+        juce::FloatVectorOperations::clear(modulation, numSamples);
+        
+        if( envelopeDepths[destination] != 0.f )
+            juce::FloatVectorOperations::addWithMultiply(modulation, getSource(ModulationSource_Envelope), envelopeDepths[destination], numSamples);
+        
+        for( const auto& slot : chainSettings.modulationSlots )
+            if( slot.destination == destination && slot.source != ModulationSource_None && slot.amount != 0.f )
+                juce::FloatVectorOperations::addWithMultiply(modulation, getSource(slot.source), slot.amount * modulationRanges[destination], numSamples);
+    }
+    
+    // the distortion gains are modulated in decibels, but applied as gains
+    for( auto destination : { Modulation_DistortionGain, Modulation_DistortionPostGain } )
+    {
+        if( ! activeModulations[destination] )
+            continue;
+        
+        auto* gains = modulationBuffer.getWritePointer(destination);
+        
+        for( int i = 0; i < numSamples; ++i )
+            gains[i] = std::exp(gains[i] * (std::log(10.f) / 20.f));
+    }
+}
+
+const float* FilterPedalAudioProcessor::getModulation(ModulationDestination destination, size_t startSample) const noexcept
+{
+    return activeModulations[destination] ? modulationBuffer.getReadPointer(destination, (int) startSample) : nullptr;
+}
+
+void FilterPedalAudioProcessor::updateDelayMemory()
+{
+    // The delay line is only backed by memory while the delay is in use, or when a bypassed
+    // delay is asked to hold on to its tail. Enabling it picks a line up from the shared pool again.
+    
+    if (getSampleRate() <= 0)
+        return;
+    
+    auto now = juce::Time::getMillisecondCounter();
     auto chainSettings = getChainSettings(apvts);
+    auto useDoublePrecision = isUsingDoublePrecision();
+    
+    // only the delay matching the host's processing precision ever holds a line
+    if (useDoublePrecision)
+        releaseDelay<float>();
+    else
+        releaseDelay<double>();
+    
+    if (! chainSettings.delayBypassed || chainSettings.delayBypassMode != DelayBypassMode::DelayBypass_Release)
+    {
+        delayBypassedSinceMs = now;
+        
+        if (useDoublePrecision)
+            allocateDelay<double>();
+        else
+            allocateDelay<float>();
+    }
+    else if (now - delayBypassedSinceMs > delayReleaseTimeoutMs)
+    {
+        releaseDelay<float>();
+        releaseDelay<double>();
+    }
+}
+
+template<typename SampleType>
+void FilterPedalAudioProcessor::allocateDelay()
+{
+    getChains<SampleType>().delay.allocate(sharedResources->getDelayMemoryPool<SampleType>());
+}
+
+template<typename SampleType>
+void FilterPedalAudioProcessor::releaseDelay()
+{
+    auto& delay = getChains<SampleType>().delay;
+    
+    if (delay.isAllocated())
+        delay.release(sharedResources->getDelayMemoryPool<SampleType>());
+}
+
+bool FilterPedalAudioProcessor::getLatestResponseModel(ResponseModel& model)
+{
+    return responseModels.read(model);
+}
+
+void FilterPedalAudioProcessor::parameterValueChanged(int parameterIndex, float newValue)
+{
+    // may be called on the audio thread, so only flag the change here
+    filterDesignsChanged = true;
+}
+
+void FilterPedalAudioProcessor::updateSharedTables()
+{
+    // built once per process on the shared background thread; until then the delay uses std::tanh
+    if( delaySaturationTable == nullptr )
+    {
+        delaySaturationTable = sharedResources->getLookupTable({ "tanh" }, [](float x) { return std::tanh(x); }, -6.f, 6.f, 2048);
+        floatChains.delay.setSaturationTable(delaySaturationTable.get());
+    }
+}
+
+void FilterPedalAudioProcessor::timerCallback()
+{
+    if( filterDesignsChanged.exchange(false) )
+        publishFilterDesigns(getChainSettings(apvts));
+    
+    updateDelayMemory();
+    updateSharedTables();
+    looper.startStreamingIfWanted();
+}
+
+juce::String getChainOrderName(const ChainOrder& order)
+{
+    static const char* stageNames[] { "LowCut", "HighCut", "Distortion", "Delay" };
+    
+    juce::String name;
+    for( auto position : order )
+    {
+        if( name.isNotEmpty() )
+            name << " > ";
+        name << stageNames[position];
+    }
+    
+    return name;
+}
+
+double ResponseModel::getMagnitudeForFrequency(double frequency) const
+{
+    auto omega = juce::MathConstants<double>::twoPi * frequency / sampleRate;
+    auto z1 = std::polar(1.0, -omega);
+    auto z2 = z1 * z1;
+    
+    double mag = 1.0;
+    
+    for( auto* cut : { &lowCut, &highCut } )
+    {
+        if( cut->bypassed )
+            continue;
+        
+        for( size_t i = 0; i < cut->numStages; ++i )
+        {
+            const auto& c = cut->stages[i];
+            auto numerator = c[0] + c[1] * z1 + c[2] * z2;
+            auto denominator = 1.0 + c[3] * z1 + c[4] * z2;
+            mag *= std::abs(numerator / denominator);
+        }
+    }
     
-    updateLowCutFilters(chainSettings);
-    updateHighCutFilters(chainSettings);
-    updateDistortion(chainSettings);
-    updateDelay(chainSettings);
+    return mag;
 }
 
 juce::AudioProcessorValueTreeState::ParameterLayout FilterPedalAudioProcessor::createParameterLayout()
@@ -349,6 +1577,18 @@ juce::AudioProcessorValueTreeState::ParameterLayout FilterPedalAudioProcessor::c
                                                            juce::NormalisableRange<float>(0.f, 0.99f, 0.01f, 1.f),
                                                            0.3f));
     
+    // runaway: added to the feedback, so it can pass 1 without remapping the feedback's own range;
+    // above 1 the repeats build up until the feedback compressor holds them at its threshold
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Delay Runaway",
+                                                           "Delay Runaway",
+                                                           juce::NormalisableRange<float>(0.f, Delay<float>::maxFeedback - 0.99f, 0.01f, 1.f),
+                                                           0.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Delay Feedback Threshold",
+                                                           "Delay Feedback Threshold",
+                                                           juce::NormalisableRange<float>(-24.f, 0.f, 0.1f, 1.f),
+                                                           -12.f));
+    
     layout.add(std::make_unique<juce::AudioParameterFloat>("Delay Time Left",
                                                            "Delay Time Left",
                                                            juce::NormalisableRange<float>(0.f, 3.f, 0.01f, 1.f),
@@ -378,6 +1618,26 @@ juce::AudioProcessorValueTreeState::ParameterLayout FilterPedalAudioProcessor::c
                                                            "Delay PostGain",
                                                            juce::NormalisableRange<float>(-48.f, 48.f, 0.1f, 1.f),
                                                            0.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Delay Routing",
+                                                            "Delay Routing",
+                                                            juce::StringArray { "Stereo", "Ping-Pong", "Cross-Feed" },
+                                                            0));
+    
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Delay Playback",
+                                                            "Delay Playback",
+                                                            juce::StringArray { "Forward", "Freeze", "Reverse" },
+                                                            0));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Delay CrossFeed",
+                                                           "Delay CrossFeed",
+                                                           juce::NormalisableRange<float>(0.f, 1.f, 0.01f, 1.f),
+                                                           0.5f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Delay Width",
+                                                           "Delay Width",
+                                                           juce::NormalisableRange<float>(0.f, 2.f, 0.01f, 1.f),
+                                                           1.f));
 
     
     juce::StringArray stringArray;
@@ -396,6 +1656,264 @@ juce::AudioProcessorValueTreeState::ParameterLayout FilterPedalAudioProcessor::c
     layout.add(std::make_unique<juce::AudioParameterBool>("HighCut Bypassed", "HighCut Bypassed", false));
     layout.add(std::make_unique<juce::AudioParameterBool>("Distortion Bypassed", "Distortion Bypassed", false));
     layout.add(std::make_unique<juce::AudioParameterBool>("Delay Bypassed", "Delay Bypassed", false));
+    layout.add(std::make_unique<juce::AudioParameterBool>("Cab Bypassed", "Cab Bypassed", false));
+    layout.add(std::make_unique<juce::AudioParameterBool>("Gate Bypassed", "Gate Bypassed", true));
+    
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Delay Bypass Mode",
+                                                            "Delay Bypass Mode",
+                                                            juce::StringArray { "Release", "Freeze", "Keep Warm" },
+                                                            0));
+    
+    juce::StringArray chainOrderNames;
+    for( const auto& order : chainOrders )
+        chainOrderNames.add(getChainOrderName(order));
+    
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Chain Order", "Chain Order", chainOrderNames, 0));
+    
+    // only affects float processing; with double buffers from the host everything runs in double
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Filter Precision",
+                                                            "Filter Precision",
+                                                            juce::StringArray { "Single", "Double" },
+                                                            0));
+    
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Cut Filter Engine",
+                                                            "Cut Filter Engine",
+                                                            juce::StringArray { "Biquad", "State Variable", "Linear Phase" },
+                                                            0));
+    
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Envelope Source",
+                                                            "Envelope Source",
+                                                            juce::StringArray { "Input", "Sidechain" },
+                                                            0));
+    
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Envelope Detector",
+                                                            "Envelope Detector",
+                                                            juce::StringArray { "Peak", "RMS" },
+                                                            0));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Envelope Attack",
+                                                           "Envelope Attack",
+                                                           juce::NormalisableRange<float>(0.1f, 100.f, 0.1f, 0.4f),
+                                                           10.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Envelope Release",
+                                                           "Envelope Release",
+                                                           juce::NormalisableRange<float>(1.f, 1000.f, 1.f, 0.4f),
+                                                           150.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Envelope Sensitivity",
+                                                           "Envelope Sensitivity",
+                                                           juce::NormalisableRange<float>(0.f, 36.f, 0.1f, 1.f),
+                                                           12.f));
+    
+    // depths at full envelope, in octaves for the cutoffs and decibels for the drive
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Envelope To LowCut",
+                                                           "Envelope To LowCut",
+                                                           juce::NormalisableRange<float>(-4.f, 4.f, 0.01f, 1.f),
+                                                           0.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Envelope To HighCut",
+                                                           "Envelope To HighCut",
+                                                           juce::NormalisableRange<float>(-4.f, 4.f, 0.01f, 1.f),
+                                                           0.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Envelope To Distortion",
+                                                           "Envelope To Distortion",
+                                                           juce::NormalisableRange<float>(-24.f, 24.f, 0.1f, 1.f),
+                                                           0.f));
+    
+    for( int i = 1; i <= (int) numLfos; ++i )
+    {
+        auto prefix = "LFO " + juce::String(i);
+        
+        layout.add(std::make_unique<juce::AudioParameterChoice>(prefix + " Shape",
+                                                                prefix + " Shape",
+                                                                juce::StringArray { "Sine", "Triangle", "Sample & Hold", "Smooth Random" },
+                                                                0));
+        
+        layout.add(std::make_unique<juce::AudioParameterFloat>(prefix + " Rate",
+                                                               prefix + " Rate",
+                                                               juce::NormalisableRange<float>(0.01f, 20.f, 0.01f, 0.3f),
+                                                               1.f));
+        
+        layout.add(std::make_unique<juce::AudioParameterChoice>(prefix + " Sync",
+                                                                prefix + " Sync",
+                                                                juce::StringArray { "Off", "1/16", "1/8", "1/4", "1/2", "1 Bar", "2 Bars", "4 Bars" },
+                                                                0));
+    }
+    
+    // the mod matrix; an amount of 1 moves the destination by its modulationRanges entry
+    for( int i = 1; i <= (int) numModulationSlots; ++i )
+    {
+        auto prefix = "Mod " + juce::String(i);
+        
+        layout.add(std::make_unique<juce::AudioParameterChoice>(prefix + " Source",
+                                                                prefix + " Source",
+                                                                juce::StringArray { "None", "LFO 1", "LFO 2", "Envelope" },
+                                                                0));
+        
+        layout.add(std::make_unique<juce::AudioParameterChoice>(prefix + " Destination",
+                                                                prefix + " Destination",
+                                                                juce::StringArray { "LowCut", "HighCut", "Distortion", "Distortion PostGain", "Delay Time" },
+                                                                0));
+        
+        layout.add(std::make_unique<juce::AudioParameterFloat>(prefix + " Amount",
+                                                               prefix + " Amount",
+                                                               juce::NormalisableRange<float>(-1.f, 1.f, 0.01f, 1.f),
+                                                               0.f));
+    }
+    
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Distortion Curve",
+                                                            "Distortion Curve",
+                                                            juce::StringArray { "Tanh", "Arctan", "Hard Clip", "Tube", "Foldback", "Diode" },
+                                                            0));
+    
+    // keeps the level steady as the amount changes, by following it or from a fixed estimate
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Distortion Auto Gain",
+                                                            "Distortion Auto Gain",
+                                                            juce::StringArray { "Off", "Tracking", "Static" },
+                                                            0));
+    
+    // multiband distortion; a single band is the plain waveshaper
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Distortion Bands",
+                                                            "Distortion Bands",
+                                                            juce::StringArray { "1", "2", "3", "4" },
+                                                            0));
+    
+    const float crossoverDefaults[] { 200.f, 1000.f, 4000.f };
+    
+    for( int i = 1; i <= 3; ++i )
+    {
+        layout.add(std::make_unique<juce::AudioParameterFloat>("Crossover " + juce::String(i),
+                                                               "Crossover " + juce::String(i),
+                                                               juce::NormalisableRange<float>(20.f, 20000.f, 1.f, 0.25f),
+                                                               crossoverDefaults[i - 1]));
+    }
+    
+    for( int i = 1; i <= 4; ++i )
+    {
+        auto prefix = "Band " + juce::String(i);
+        
+        layout.add(std::make_unique<juce::AudioParameterFloat>(prefix + " Drive",
+                                                               prefix + " Drive",
+                                                               juce::NormalisableRange<float>(-24.f, 24.f, 0.1f, 1.f),
+                                                               0.f));
+        
+        layout.add(std::make_unique<juce::AudioParameterFloat>(prefix + " PostGain",
+                                                               prefix + " PostGain",
+                                                               juce::NormalisableRange<float>(-24.f, 24.f, 0.1f, 1.f),
+                                                               0.f));
+    }
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Delay Diffusion",
+                                                           "Delay Diffusion",
+                                                           juce::NormalisableRange<float>(0.f, 1.f, 0.01f, 1.f),
+                                                           0.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Delay Diffusion Decay",
+                                                           "Delay Diffusion Decay",
+                                                           juce::NormalisableRange<float>(0.f, 0.95f, 0.01f, 1.f),
+                                                           0.5f));
+    
+    // ducking: the repeats make room while the input is playing; no depth is no ducking
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Delay Duck Threshold",
+                                                           "Delay Duck Threshold",
+                                                           juce::NormalisableRange<float>(-60.f, 0.f, 0.1f, 1.f),
+                                                           -30.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Delay Duck Depth",
+                                                           "Delay Duck Depth",
+                                                           juce::NormalisableRange<float>(0.f, 48.f, 0.1f, 1.f),
+                                                           0.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Delay Duck Release",
+                                                           "Delay Duck Release",
+                                                           juce::NormalisableRange<float>(10.f, 2000.f, 1.f, 0.5f),
+                                                           250.f));
+    
+    // shimmer: semitones each repeat is shifted by on its way back into the line
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Delay Pitch Shift",
+                                                           "Delay Pitch Shift",
+                                                           juce::NormalisableRange<float>(-12.f, 12.f, 0.1f, 1.f),
+                                                           0.f));
+    
+    // multi-tap delay: extra taps read from the delay's own line
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Delay Taps",
+                                                            "Delay Taps",
+                                                            juce::StringArray { "Off", "1", "2", "3", "4", "5", "6", "7", "8" },
+                                                            0));
+    
+    for( int i = 1; i <= (int) Delay<float>::maxNumTaps; ++i )
+    {
+        auto prefix = "Tap " + juce::String(i);
+        
+        layout.add(std::make_unique<juce::AudioParameterFloat>(prefix + " Time",
+                                                               prefix + " Time",
+                                                               juce::NormalisableRange<float>(0.f, 3.f, 0.01f, 1.f),
+                                                               0.125f * (float) i));
+        
+        layout.add(std::make_unique<juce::AudioParameterFloat>(prefix + " Level",
+                                                               prefix + " Level",
+                                                               juce::NormalisableRange<float>(0.f, 1.f, 0.01f, 1.f),
+                                                               0.5f));
+        
+        layout.add(std::make_unique<juce::AudioParameterFloat>(prefix + " Pan",
+                                                               prefix + " Pan",
+                                                               juce::NormalisableRange<float>(-1.f, 1.f, 0.01f, 1.f),
+                                                               0.f));
+        
+        layout.add(std::make_unique<juce::AudioParameterFloat>(prefix + " HighCut",
+                                                               prefix + " HighCut",
+                                                               juce::NormalisableRange<float>(20.f, 20000.f, 1.f, 0.25f),
+                                                               20000.f));
+    }
+    
+    // the input gate ahead of the distortion
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Gate Threshold",
+                                                           "Gate Threshold",
+                                                           juce::NormalisableRange<float>(-90.f, 0.f, 0.1f, 1.f),
+                                                           -60.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Gate Hysteresis",
+                                                           "Gate Hysteresis",
+                                                           juce::NormalisableRange<float>(0.f, 20.f, 0.1f, 1.f),
+                                                           6.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Gate Hold",
+                                                           "Gate Hold",
+                                                           juce::NormalisableRange<float>(0.f, 500.f, 1.f, 0.5f),
+                                                           50.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Gate Release",
+                                                           "Gate Release",
+                                                           juce::NormalisableRange<float>(5.f, 1000.f, 1.f, 0.5f),
+                                                           100.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Gate Lookahead",
+                                                           "Gate Lookahead",
+                                                           juce::NormalisableRange<float>(0.f, NoiseGate<float>::maxLookaheadTime, 0.1f, 1.f),
+                                                           0.f));
+    
+    // the safety limiter on the output, as a true-peak ceiling; off unless asked for, as it adds latency
+    layout.add(std::make_unique<juce::AudioParameterBool>("Limiter Bypassed", "Limiter Bypassed", true));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Limiter Ceiling",
+                                                           "Limiter Ceiling",
+                                                           juce::NormalisableRange<float>(-12.f, 0.f, 0.1f, 1.f),
+                                                           -1.f));
+    
+    layout.add(std::make_unique<juce::AudioParameterFloat>("Limiter Release",
+                                                           "Limiter Release",
+                                                           juce::NormalisableRange<float>(10.f, 1000.f, 1.f, 0.5f),
+                                                           100.f));
+    
+    // the looper after the whole chain
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Looper",
+                                                            "Looper",
+                                                            juce::StringArray { "Stop", "Record", "Overdub", "Play" },
+                                                            0));
+    
+    layout.add(std::make_unique<juce::AudioParameterBool>("Looper Undo", "Looper Undo", false));
     
     return layout;
 }
@@ -10,6 +10,9 @@
 
 #include <JuceHeader.h>
 #include "Components.h"
+#include "SharedDspResources.h"
+#include "Convolution.h"
+#include "Looper.h"
 
 
 enum Slope
@@ -20,6 +23,81 @@ enum Slope
     Slope_48
 };
 
+/** How the cut filters are implemented. */
+enum CutFilterEngine
+{
+    CutFilterEngine_Biquad,     // the designed biquad cascade, stepped to new coefficients each block
+    CutFilterEngine_Svf,        // state variable cascade, its cutoff ramped across each block
+    CutFilterEngine_LinearPhase // both cuts' magnitude responses in one FIR, with latency
+};
+
+/** Where the envelope follower listens. */
+enum EnvelopeSource
+{
+    EnvelopeSource_Input,
+    EnvelopeSource_Sidechain    // falls back to the input while the sidechain bus is disabled
+};
+
+/** Per-sample modulation buffers, one channel each: octaves for the cutoffs and the
+    delay time, linear gain for the distortion.
+*/
+enum ModulationDestination
+{
+    Modulation_LowCut,
+    Modulation_HighCut,
+    Modulation_DistortionGain,
+    Modulation_DistortionPostGain,
+    Modulation_DelayTime,
+    numModulationDestinations
+};
+
+/** How far each destination moves for a modulation amount of 1, in its own units. */
+inline constexpr std::array<float, numModulationDestinations> modulationRanges { 4.f, 4.f, 24.f, 24.f, 1.f };
+
+enum ModulationSource
+{
+    ModulationSource_None,
+    ModulationSource_Lfo1,
+    ModulationSource_Lfo2,
+    ModulationSource_Envelope,
+    numModulationSources
+};
+
+inline constexpr size_t numLfos = 2;
+inline constexpr size_t numModulationSlots = 4;
+
+/** LFO rates locked to the host tempo, in beats per cycle; 0 leaves the LFO free running. */
+inline constexpr std::array<double, 8> lfoSyncBeats { 0, 0.25, 0.5, 1, 2, 4, 8, 16 };
+
+struct LfoSettings
+{
+    Lfo<float>::Shape shape { Lfo<float>::sine };
+    float rate { 1 };
+    size_t sync { 0 };
+};
+
+/** One row of the mod matrix: source times amount, added to the destination. */
+struct ModulationSlot
+{
+    ModulationSource source { ModulationSource::ModulationSource_None };
+    ModulationDestination destination { ModulationDestination::Modulation_LowCut };
+    float amount { 0 };
+};
+
+/** One of the delay's extra output taps. */
+struct DelayTapSettings
+{
+    float time { 0.25f }, level { 0 }, pan { 0 }, highCut { 20000 };
+};
+
+/** What the delay does with its line while it is bypassed. */
+enum DelayBypassMode
+{
+    DelayBypass_Release,    // stops, and hands its memory back to the pool after a while
+    DelayBypass_Freeze,     // stops, holding the tail until it is enabled again
+    DelayBypass_KeepWarm    // keeps writing the input into the line, but nothing else
+};
+
 struct ChainSettings
 {
     float lowCutFreq { 0 }, highCutFreq { 0 };
@@ -28,36 +106,199 @@ struct ChainSettings
     
     float distortionPreGainInDecibels { 0 }, distortionPostGainInDecibels { 0 };
     
+    AdaaWaveShaper<float>::Curve distortionCurve { AdaaWaveShaper<float>::tanh };
+    
+    Distortion<float>::AutoGain distortionAutoGain { Distortion<float>::autoGainOff };
+    
+    size_t distortionBands { 1 };
+    
+    std::array<float, MultibandDistortion<float>::maxNumBands - 1> crossoverFreqs { 200, 1000, 4000 };
+    
+    // per band offsets, added to the distortion's own drive and post gain
+    std::array<float, MultibandDistortion<float>::maxNumBands> bandDrives {}, bandPostGains {};
+    
     float delayDry { 1 }, delayWet { 0 }, delayFeedback { 0 }, delayTimeLeft { 0 }, delayTimeRight { 0 }, delayLowCutFreq { 500 }, delayHighCutFreq { 5000 }, delayDistortionPreGain { 0 }, delayDistortionPostGain { 0 };
     
+    DelayRouting delayRouting { DelayRouting::Routing_Stereo };
+    
+    DelayPlayback delayPlayback { DelayPlayback::Playback_Forward };
+    
+    size_t delayTaps { 0 };
+    
+    std::array<DelayTapSettings, Delay<float>::maxNumTaps> delayTapSettings;
+    
+    float delayCrossFeed { 0.5f }, delayWidth { 1 };
+    
+    float delayDiffusion { 0 }, delayDiffusionDecay { 0.5f };
+    
+    float delayDuckThreshold { -30 }, delayDuckDepth { 0 }, delayDuckRelease { 250 };
+    
+    float delayPitchShift { 0 };
+    
+    float delayRunaway { 0 }, delayFeedbackThreshold { -12 };
+    
     bool lowCutBypassed { false }, highCutBypassed { false }, distortionBypassed { false }, delayBypassed { false };
+    
+    bool cabinetBypassed { false };
+    
+    bool gateBypassed { true };
+    
+    bool limiterBypassed { true };
+    
+    float limiterCeiling { -1 }, limiterRelease { 100 };
+    
+    Looper::Mode looperMode { Looper::stopped };
+    
+    bool looperUndo { false };
+    
+    float gateThreshold { -60 }, gateHysteresis { 6 }, gateHold { 50 }, gateRelease { 100 }, gateLookahead { 0 };
+    
+    DelayBypassMode delayBypassMode { DelayBypassMode::DelayBypass_Release };
+    
+    size_t chainOrder { 0 };
+    
+    bool doublePrecisionFilters { false };
+    
+    CutFilterEngine cutFilterEngine { CutFilterEngine::CutFilterEngine_Biquad };
+    
+    EnvelopeSource envelopeSource { EnvelopeSource::EnvelopeSource_Input };
+    
+    bool envelopeRms { false };
+    
+    float envelopeAttack { 10 }, envelopeRelease { 150 }, envelopeSensitivity { 12 };
+    
+    float envelopeToLowCut { 0 }, envelopeToHighCut { 0 }, envelopeToDistortion { 0 };
+    
+    std::array<LfoSettings, numLfos> lfos;
+    
+    std::array<ModulationSlot, numModulationSlots> modulationSlots;
+    
+    bool modulatesCutoffs() const noexcept;
+    
+    /** The engine the cut filters actually run on, which can differ from cutFilterEngine. */
+    CutFilterEngine getActiveCutFilterEngine() const noexcept;
 };
 
 ChainSettings getChainSettings(juce::AudioProcessorValueTreeState& apvts);
 
+struct FilterDesigns
+{
+    CutFilterDesign lowCut, highCut;
+    double sampleRate { 44100 };
+    
+    // the shared cache entries the designs were copied from, held for as long as this set is
+    SharedDspResources::CutFilterDesignPtr lowCutEntry, highCutEntry;
+    
+    bool operator==(const FilterDesigns& other) const noexcept
+    {
+        return lowCut == other.lowCut && highCut == other.highCut && sampleRate == other.sampleRate;
+    }
+    
+    bool operator!=(const FilterDesigns& other) const noexcept { return ! operator==(other); }
+};
+
+FilterDesigns designFilters(const ChainSettings& chainSettings, double sampleRate, SharedDspResources& resources);
+
+/** Everything the editor needs to draw the response curve: plain coefficient values
+    copied out of the processor's filter designs, without any filter state or delay memory.
+*/
+struct ResponseModel
+{
+    CutFilterDesign lowCut, highCut;
+    
+    float distortionPreGain { 0 }, distortionPostGain { 0 };
+    bool distortionBypassed { false };
+    
+    double sampleRate { 44100 };
+    
+    double getMagnitudeForFrequency(double frequency) const;
+};
+
 using Filter = juce::dsp::IIR::Filter<float>;
 
-using CutFilter = juce::dsp::ProcessorChain<Filter, Filter, Filter, Filter>;
+template<typename SampleType>
+using CutFilter = juce::dsp::ProcessorChain<juce::dsp::IIR::Filter<SampleType>,
+                                            juce::dsp::IIR::Filter<SampleType>,
+                                            juce::dsp::IIR::Filter<SampleType>,
+                                            juce::dsp::IIR::Filter<SampleType>>;
+
+template<typename SampleType>
+using WaveShaper = juce::dsp::ProcessorChain<Distortion<SampleType>>;
 
-using DelayChain = juce::dsp::ProcessorChain<Delay<float>>;
+template<typename SampleType>
+using MonoChain = juce::dsp::ProcessorChain<CutFilter<SampleType>, CutFilter<SampleType>, WaveShaper<SampleType>, NoiseGate<SampleType>>;
 
-using WaveShaper = juce::dsp::ProcessorChain<Distortion<float>>;
+/** Where the input gate sits in a MonoChain, which differs from its ChainPositions value. */
+inline constexpr size_t monoChainGateIndex = 3;
 
-using MonoChain = juce::dsp::ProcessorChain<CutFilter, CutFilter, WaveShaper, DelayChain>;
+template<typename SampleType>
+using StereoDelay = Delay<SampleType, 2>;
 
 enum ChainPositions
 {
     LowCut,
     HighCut,
     WaveshapingDistortion,
-    DistortedDelay
+    DistortedDelay,     // the stereo delay, which runs on both channels outside the MonoChains
+    CabinetSimulator,   // the impulse response stage, which isn't in a ChainOrder: it always follows the distortion
+    InputGate           // the noise gate, which isn't in a ChainOrder either: it always comes just before the distortion
 };
 
+/** A processing order: the four ChainPositions in the sequence they run. */
+using ChainOrder = std::array<int, 4>;
+
+constexpr std::array<ChainOrder, 24> makeChainOrders()
+{
+    std::array<ChainOrder, 24> orders {};
+    size_t numOrders = 0;
+    
+    for( int a = 0; a < 4; ++a )
+        for( int b = 0; b < 4; ++b )
+            for( int c = 0; c < 4; ++c )
+                for( int d = 0; d < 4; ++d )
+                    if( a != b && a != c && a != d && b != c && b != d && c != d )
+                        orders[numOrders++] = { a, b, c, d };
+    
+    return orders;
+}
+
+/** Every ordering of the stages, indexed by the "Chain Order" parameter.
+    The first one is the original LowCut > HighCut > Distortion > Delay.
+*/
+inline constexpr auto chainOrders = makeChainOrders();
+
+juce::String getChainOrderName(const ChainOrder& order);
+
 using Coefficients = Filter::CoefficientsPtr;
-void updateCoefficients(Coefficients& old, const Coefficients& replacements);
 
 Coefficients makePeakFilter(const ChainSettings& chainSettings, double sampleRate);
 
+template<typename CoefficientsPtr>
+void updateCoefficients(CoefficientsPtr& old, const BiquadCoefficients& replacements)
+{
+    // Copies the values into the filter's existing coefficient object instead of swapping
+    // objects, so nothing is allocated or released on the audio thread.
+    jassert(old->coefficients.size() == (int) replacements.size());
+    
+    using SampleType = std::decay_t<decltype(*old->getRawCoefficients())>;
+    
+    std::transform(replacements.begin(), replacements.end(), old->getRawCoefficients(),
+                   [](double c) { return static_cast<SampleType>(c); });
+}
+
+template<typename SampleType>
+void prepareCutFilterCoefficients(CutFilter<SampleType>& chain)
+{
+    // Gives every stage its own biquad-sized coefficient object up front. The audio thread
+    // then only ever copies values into these, and never allocates or frees a set.
+    auto makeBiquad = [] { return new juce::dsp::IIR::Coefficients<SampleType>(1, 0, 0, 1, 0, 0); };
+    
+    chain.template get<0>().coefficients = makeBiquad();
+    chain.template get<1>().coefficients = makeBiquad();
+    chain.template get<2>().coefficients = makeBiquad();
+    chain.template get<3>().coefficients = makeBiquad();
+}
+
 template<int Index, typename ChainType, typename CoefficientType>
 void update(ChainType& chain, const CoefficientType& coefficients)
 {
@@ -65,35 +306,38 @@ void update(ChainType& chain, const CoefficientType& coefficients)
     chain.template setBypassed<Index>(false);
 }
 
-template<typename ChainType, typename CoefficientType>
+template<typename ChainType>
 void updateCutFilter(ChainType& chain,
-                     const CoefficientType& coefficients,
-                     const Slope& slope)
+                     const CutFilterDesign& design)
 {
 
     chain.template setBypassed<0>(true);
     chain.template setBypassed<1>(true);
     chain.template setBypassed<2>(true);
     chain.template setBypassed<3>(true);
+    
+    // a default-constructed design has no stages, which leaves the whole cut bypassed
+    if( design.numStages == 0 )
+        return;
 
-    switch( slope )
+    switch( static_cast<Slope>(design.numStages - 1) )
     {
 
         case Slope_48:
         {
-            update<3>(chain, coefficients);
+            update<3>(chain, design.stages);
         }
         case Slope_36:
         {
-            update<2>(chain, coefficients);
+            update<2>(chain, design.stages);
         }
         case Slope_24:
         {
-            update<1>(chain, coefficients);
+            update<1>(chain, design.stages);
         }
         case Slope_12:
         {
-            update<0>(chain, coefficients);
+            update<0>(chain, design.stages);
         }
     }
 }
@@ -101,80 +345,65 @@ void updateCutFilter(ChainType& chain,
 template<typename ChainType, typename SettingsType>
 void updateDistortionGain(ChainType& chain, SettingsType chainSettings)
 {
-    chain.template setBypassed<0>(true);
-    chain.template setBypassed<1>(true);
-    chain.template setBypassed<2>(true);
-
     chain.template get<0>().setPreGain(chainSettings.distortionPreGainInDecibels);
     chain.template get<0>().setPostGain(chainSettings.distortionPostGainInDecibels);
-    
-    chain.template setBypassed<0>(false);
-    chain.template setBypassed<1>(false);
-    chain.template setBypassed<2>(false);
 }
 
-template<typename ChainType, typename SettingsType, typename ChannelNumber>
-void updateDelayValues(ChainType& chain, SettingsType chainSettings, ChannelNumber channelNumber)
+template<typename DelayType, typename SettingsType>
+void updateDelayValues(DelayType& delay, const SettingsType& chainSettings)
 {
-    chain.template setBypassed<0>(true);
-    
-    chain.template get<0>().setDryLevel(chainSettings.delayDry);
-    chain.template get<0>().setWetLevel(chainSettings.delayWet);
-    chain.template get<0>().setFeedback(chainSettings.delayFeedback);
+    delay.setDryLevel(chainSettings.delayDry);
+    delay.setWetLevel(chainSettings.delayWet);
+    delay.setFeedback(chainSettings.delayFeedback + chainSettings.delayRunaway);
+    delay.setFeedbackThreshold(chainSettings.delayFeedbackThreshold);
     
-    chain.template get<0>().setLowCutFreq(chainSettings.delayLowCutFreq);
-    chain.template get<0>().setHighCutFreq(chainSettings.delayHighCutFreq);
-
-    chain.template get<0>().setDistortionPreGainAmount(chainSettings.delayDistortionPreGain);
-    chain.template get<0>().setDistortionPostGainAmount(chainSettings.delayDistortionPostGain);
+    delay.setLowCutFreq(chainSettings.delayLowCutFreq);
+    delay.setHighCutFreq(chainSettings.delayHighCutFreq);
 
-    switch( channelNumber )
-    {
-        case 0:
-        {
-            chain.template get<0>().setDelayTime(0, chainSettings.delayTimeLeft);
-            break;
-        }
-        case 1:
-        {
-            chain.template get<0>().setDelayTime(0, chainSettings.delayTimeRight);
-            break;
-
-        }
-    }
+    delay.setDistortionPreGainAmount(chainSettings.delayDistortionPreGain);
+    delay.setDistortionPostGainAmount(chainSettings.delayDistortionPostGain);
     
-    chain.template setBypassed<0>(false);
-}
-
-template<typename ChainType, typename SettingsType>
-void muteDelay(ChainType& chain, SettingsType chainSettings)
-{
-    chain.template setBypassed<0>(true);
-
-    chain.template get<0>().setDryLevel(1);
-    chain.template get<0>().setWetLevel(0);
+    delay.setRouting(chainSettings.delayRouting);
+    delay.setPlayback(chainSettings.delayPlayback);
+    delay.setCrossFeed(chainSettings.delayCrossFeed);
+    delay.setWidth(chainSettings.delayWidth);
+    delay.setDiffusion(chainSettings.delayDiffusion, chainSettings.delayDiffusionDecay);
+    delay.setDucking(chainSettings.delayDuckThreshold, chainSettings.delayDuckDepth, chainSettings.delayDuckRelease);
+    delay.setPitchShift(chainSettings.delayPitchShift);
+
+    delay.setDelayTime(0, chainSettings.delayTimeLeft);
+    delay.setDelayTime(1, chainSettings.delayTimeRight);
+    
+    delay.setNumTaps(chainSettings.delayTaps);
     
-    chain.template setBypassed<0>(false);
+    for( size_t i = 0; i < chainSettings.delayTapSettings.size(); ++i )
+    {
+        const auto& tap = chainSettings.delayTapSettings[i];
+        delay.setTap(i, tap.time, tap.level, tap.pan, tap.highCut);
+    }
 }
 
+// designed in double: near z = 1, at low cutoffs and high rates, float would already have moved the poles
 inline auto makeLowCutFilter(const ChainSettings& chainSettings, double sampleRate )
 {
-    return juce::dsp::FilterDesign<float>::designIIRHighpassHighOrderButterworthMethod(chainSettings.lowCutFreq,
-                                                                                       sampleRate,
-                                                                                       2* (chainSettings.lowCutSlope + 1));
+    return juce::dsp::FilterDesign<double>::designIIRHighpassHighOrderButterworthMethod(chainSettings.lowCutFreq,
+                                                                                        sampleRate,
+                                                                                        2* (chainSettings.lowCutSlope + 1));
 }
 
 inline auto makeHighCutFilter(const ChainSettings& chainSettings, double sampleRate )
 {
-    return juce::dsp::FilterDesign<float>::designIIRLowpassHighOrderButterworthMethod(chainSettings.highCutFreq,
-                                                                                      sampleRate,
-                                                                                      2* (chainSettings.highCutSlope + 1));
+    return juce::dsp::FilterDesign<double>::designIIRLowpassHighOrderButterworthMethod(chainSettings.highCutFreq,
+                                                                                       sampleRate,
+                                                                                       2* (chainSettings.highCutSlope + 1));
 }
 
 //==============================================================================
 /**
 */
-class FilterPedalAudioProcessor  : public juce::AudioProcessor
+class FilterPedalAudioProcessor  : public juce::AudioProcessor,
+                                   private juce::AudioProcessorParameter::Listener,
+                                   private juce::Timer
 {
 public:
     //==============================================================================
@@ -190,6 +419,9 @@ public:
    #endif
 
     void processBlock (juce::AudioBuffer<float>&, juce::MidiBuffer&) override;
+    void processBlock (juce::AudioBuffer<double>&, juce::MidiBuffer&) override;
+    
+    bool supportsDoublePrecisionProcessing() const override;
 
     //==============================================================================
     juce::AudioProcessorEditor* createEditor() override;
@@ -217,17 +449,220 @@ public:
     static juce::AudioProcessorValueTreeState::ParameterLayout createParameterLayout();
     juce::AudioProcessorValueTreeState apvts {*this, nullptr, "Parameters", createParameterLayout()};
     
+    /** Copies the newest response model into model, returning false if it hasn't changed
+        since the last call. Only one editor may poll this.
+    */
+    bool getLatestResponseModel(ResponseModel& model);
+    
+    /** Asks for the response model to be published again, e.g. when a new editor opens. */
+    void invalidateResponseModel() { filterDesignsChanged = true; }
+    
+    /** Loads a WAV impulse response into the cabinet stage, in the background, and keeps
+        its path in the state so it's loaded again with the session.
+    */
+    void loadCabinetImpulseResponse(const juce::File& file);
+    
+    /** The file the cabinet's response was loaded from, kept in the state; empty if there's none. */
+    juce::File getCabinetImpulseResponseFile() const;
+    
 private:
-    MonoChain leftChain, rightChain;
+    /** Everything that processes samples, in one precision. Float host buffers run through
+        floatChains, except that their cut filters can run in doubleChains (the mixed mode);
+        double host buffers run entirely through doubleChains.
+    */
+    template<typename SampleType>
+    struct Chains
+    {
+        MonoChain<SampleType> left, right;
+        StereoDelay<SampleType> delay;
+        
+        /** The state variable engine's cut filters, one per channel. */
+        std::array<SvfCutFilter<SampleType>, 2> lowCutSvfs, highCutSvfs;
+        
+        /** Takes over from the waveshaper when the distortion is split into bands, one per channel. */
+        std::array<MultibandDistortion<SampleType>, 2> multibandDistortions;
+        
+        EnvelopeFollower<SampleType> envelopeFollower;
+        
+        /** The safety limiter on the output, after everything else. */
+        TruePeakLimiter<SampleType> limiter;
+        bool limiterActive { false };
+        
+        juce::AudioBuffer<SampleType> stageDryBuffer;
+    };
+    
+    Chains<float> floatChains;
+    Chains<double> doubleChains;
+    
+    template<typename SampleType>
+    Chains<SampleType>& getChains() noexcept
+    {
+        if constexpr (std::is_same_v<SampleType, double>)
+            return doubleChains;
+        else
+            return floatChains;
+    }
+    
+    /** Float samples converted for the double cut filters in the mixed mode. */
+    juce::AudioBuffer<double> mixedPrecisionBuffer;
+    bool doublePrecisionFilters { false };
+    
+    CutFilterEngine cutFilterEngine { CutFilterEngine::CutFilterEngine_Biquad };
+    
+    //==============================================================================
+    /** Modulation for the current block, indexed by ModulationDestination. Only the
+        destinations flagged in activeModulations are filled in.
+    */
+    juce::AudioBuffer<float> modulationBuffer;
+    std::array<bool, numModulationDestinations> activeModulations {};
+    
+    juce::AudioBuffer<float> envelopeBuffer;
+    
+    std::array<Lfo<float>, numLfos> lfos;
+    juce::AudioBuffer<float> lfoBuffer;
     
-    std::unique_ptr<Distortion<float>> distortion;
+    template<typename SampleType>
+    void updateModulation(const ChainSettings& chainSettings, juce::AudioBuffer<SampleType>& buffer);
     
-    void updateLowCutFilters(const ChainSettings& chainSettings);
-    void updateHighCutFilters(const ChainSettings& chainSettings);
+    /** The modulation for a destination from startSample in the current block, or nullptr if it isn't modulated. */
+    const float* getModulation(ModulationDestination destination, size_t startSample) const noexcept;
+    
+    /** Clears a cut filter stage's state, in both precisions and both engines. */
+    template<int Position>
+    void resetCutFilter();
+    
+    juce::SharedResourcePointer<SharedDspResources> sharedResources;
+    
+    SharedDspResources::LookupTablePtr delaySaturationTable;
+    
+    juce::uint32 delayBypassedSinceMs { 0 };
+    
+    static constexpr juce::uint32 delayReleaseTimeoutMs { 5000 };
+    
+    TripleBuffer<FilterDesigns> filterDesigns;
+    
+    void publishFilterDesigns(const ChainSettings& chainSettings);
+    void applyFilterDesigns(const FilterDesigns& designs);
+    
+    /** The linear phase engine, shared with the background jobs that design its kernels. */
+    std::shared_ptr<LinearPhaseFilter> linearPhaseFilter { std::make_shared<LinearPhaseFilter>() };
+    
+    // what the newest kernel was designed from: on the message thread, and for offline renders on the audio thread
+    FilterDesigns linearPhaseDesigns, offlineLinearPhaseDesigns;
+    
+    void designLinearPhaseKernel(const FilterDesigns& designs, bool inBackground);
+    void updateLatency(const ChainSettings& chainSettings);
+    
+    /** What the latency last reported to the host was worked out from. Anything that adds
+        latency follows these on the audio thread rather than the parameters, so it only
+        changes once the host has been told, and no block comes out misaligned.
+    */
+    std::atomic<bool> reportedLinearPhase { false }, reportedLimiter { false };
+    std::atomic<float> reportedGateLookahead { 0.f };
+    
+    /** Audio thread: holds the settings that add latency to what was last reported. */
+    void followReportedLatency(ChainSettings& chainSettings) const;
+    
+    /** The cabinet stage, shared with the background jobs that load its responses. */
+    std::shared_ptr<ImpulseResponseStage> cabinet { std::make_shared<ImpulseResponseStage>() };
+    
+    static constexpr const char* cabinetFileProperty = "CabImpulseResponse";
+    
+    /** Loads the response named in the state for the current sample rate, in the background. */
+    void updateCabinet();
+    
+    /** The looper at the end of the chain, one for both channels so they share a transport. */
+    Looper looper;
+    
+    // undo is a button: it acts when it goes down, not while it's held
+    bool looperUndoHeld { false };
+    Looper::Mode looperModeRequested { Looper::stopped };
+    
+    void updateLooper(const ChainSettings& chainSettings);
+    
+    void updateCutFilters(const ChainSettings& chainSettings);
+    
+    template<typename SampleType>
     void updateDistortion(const ChainSettings& chainSettings);
+    
+    template<typename SampleType>
     void updateDelay(const ChainSettings& chainSettings);
     
-    void updateComponents();
+    template<typename SampleType>
+    void updateGate(const ChainSettings& chainSettings);
+    
+    template<typename SampleType>
+    void updateLimiter(const ChainSettings& chainSettings);
+    
+    template<typename SampleType>
+    void updateComponents(const ChainSettings& chainSettings);
+    
+    //==============================================================================
+    template<typename SampleType>
+    using ChainOrderProcessor = void (FilterPedalAudioProcessor::*)(juce::dsp::AudioBlock<SampleType>&, size_t);
+    
+    size_t activeChainOrder { 0 };
+    int chainOrderFadeSamples { 0 };
+    
+    // where an order change's fade is, carried across blocks: below chainOrderFadeSamples the
+    // old order is fading out, from there to twice that the new one is fading in; -1 when idle
+    int chainOrderFadePosition { -1 };
+    
+    template<typename SampleType>
+    void processSamples(juce::AudioBuffer<SampleType>& buffer);
+    
+    template<typename SampleType>
+    void processChain(const ChainSettings& chainSettings, juce::dsp::AudioBlock<SampleType>& block);
+    
+    template<typename SampleType, size_t... OrderIndices>
+    static constexpr std::array<ChainOrderProcessor<SampleType>, sizeof...(OrderIndices)> makeChainOrderProcessors(std::index_sequence<OrderIndices...>);
+    
+    // startSample is where the block starts within the host's buffer, for reading the modulation
+    template<size_t OrderIndex, typename SampleType>
+    void processInOrder(juce::dsp::AudioBlock<SampleType>& block, size_t startSample);
+    
+    /** Runs the stage at an order position, and the stages that always follow it. */
+    template<int Position, typename SampleType>
+    void processPosition(juce::dsp::AudioBlock<SampleType>& block, size_t startSample);
+    
+    template<int Position, typename SampleType>
+    void processStage(juce::dsp::AudioBlock<SampleType>& block, size_t startSample);
+    
+    template<int Position, typename SampleType>
+    void runStage(juce::dsp::AudioBlock<SampleType>& block, size_t startSample);
+    
+    template<int Position>
+    void runStageInDoublePrecision(juce::dsp::AudioBlock<float>& block, size_t startSample);
+    
+    //==============================================================================
+    /** How much of each stage's output is heard, indexed by ChainPositions. A stage at 0
+        isn't run at all; while one ramps, its output is crossfaded with its input.
+    */
+    std::array<juce::SmoothedValue<float>, 6> stageMixes;
+    
+    /** Set by the gate when its output is silent, until a stage that can ring runs after it. */
+    bool inputGateSilent { false };
+    
+    DelayBypassMode delayBypassMode { DelayBypassMode::DelayBypass_Release };
+    
+    void setStageEnabled(int position, bool shouldBeEnabled);
+    
+    void updateDelayMemory();
+    
+    template<typename SampleType>
+    void allocateDelay();
+    
+    template<typename SampleType>
+    void releaseDelay();
+    void updateSharedTables();
+    
+    TripleBuffer<ResponseModel> responseModels;
+    std::atomic<bool> filterDesignsChanged { true };
+    
+    void parameterValueChanged(int parameterIndex, float newValue) override;
+    void parameterGestureChanged(int parameterIndex, bool gestureIsStarting) override { }
+    
+    void timerCallback() override;
     
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (FilterPedalAudioProcessor)
@@ -0,0 +1,157 @@
+//
+//  SharedDspResources.h
+//  FilterPedal
+//
+
+#pragma once
+
+#include <JuceHeader.h>
+#include "Components.h"
+#include "Convolution.h"
+
+//==============================================================================
+/** Read-only DSP data shared by every FilterPedal instance in the host process.
+
+    Use it through a juce::SharedResourcePointer: the first instance creates it,
+    the last one to go away destroys it. Everything handed out is immutable, so
+    instances with the same sample rate and settings share one copy of each
+    filter design and lookup table instead of keeping their own.
+
+    None of these calls are realtime safe; they take a lock and may allocate.
+*/
+class SharedDspResources
+{
+public:
+    //==============================================================================
+    using LookupTable = juce::dsp::LookupTableTransform<float>;
+    using LookupTablePtr = std::shared_ptr<const LookupTable>;
+    using CutFilterDesignPtr = std::shared_ptr<const CutFilterDesign>;
+
+    /** Identifies a table or design: what it is, the sample rate it was made for
+        (0 if it doesn't depend on one) and the parameter value it was made from.
+    */
+    struct Key
+    {
+        juce::String name;
+        double sampleRate { 0 };
+        double parameter { 0 };
+        int variant { 0 };
+
+        bool operator< (const Key& other) const noexcept
+        {
+            return std::tie (name, sampleRate, parameter, variant)
+                 < std::tie (other.name, other.sampleRate, other.parameter, other.variant);
+        }
+    };
+
+    //==============================================================================
+    SharedDspResources() = default;
+
+    ~SharedDspResources()
+    {
+        backgroundPool.removeAllJobs (true, 2000);
+    }
+
+    //==============================================================================
+    template <typename SampleType>
+    DelayMemoryPool<SampleType>& getDelayMemoryPool() noexcept
+    {
+        if constexpr (std::is_same_v<SampleType, double>)
+            return doubleDelayMemoryPool;
+        else
+            return delayMemoryPool;
+    }
+
+    //==============================================================================
+    /** Returns the shared design for key, running designer to make it if nobody holds
+        one. The cache only keeps designs that are still held somewhere, so a parameter
+        sweep in one instance can't push out the designs other instances are using.
+    */
+    template <typename Designer>
+    CutFilterDesignPtr getCutFilterDesign (const Key& key, Designer&& designer)
+    {
+        {
+            const juce::ScopedLock sl (designLock);
+
+            auto it = cutFilterDesigns.find (key);
+
+            if (it != cutFilterDesigns.end())
+                if (auto design = it->second.lock())
+                    return design;
+        }
+
+        auto design = std::make_shared<const CutFilterDesign> (designer());
+
+        const juce::ScopedLock sl (designLock);
+
+        // the designs nobody holds any more make way as new ones come in
+        for (auto it = cutFilterDesigns.begin(); it != cutFilterDesigns.end();)
+            it = it->second.expired() ? cutFilterDesigns.erase (it) : std::next (it);
+
+        cutFilterDesigns[key] = design;
+        return design;
+    }
+
+    //==============================================================================
+    /** Returns the lookup table for key if it has been built. Otherwise schedules it
+        to be built on the background thread from function, sampled over
+        [minInput, maxInput], and returns nullptr; ask again later.
+    */
+    LookupTablePtr getLookupTable (const Key& key,
+                                   std::function<float (float)> function,
+                                   float minInput,
+                                   float maxInput,
+                                   size_t numPoints)
+    {
+        const juce::ScopedLock sl (tableLock);
+
+        auto it = lookupTables.find (key);
+
+        if (it != lookupTables.end())
+            return it->second;  // nullptr while it's still being built
+
+        lookupTables.emplace (key, nullptr);
+
+        runInBackground ([this, key, function = std::move (function), minInput, maxInput, numPoints]
+        {
+            auto table = std::make_shared<LookupTable>();
+            table->initialise (function, minInput, maxInput, numPoints);
+
+            const juce::ScopedLock tableSl (tableLock);
+            lookupTables[key] = std::move (table);
+        });
+
+        return nullptr;
+    }
+
+    //==============================================================================
+    /** The thread every instance's cabinet convolver runs its tail on. */
+    ConvolutionTailWorker& getConvolutionTailWorker() noexcept
+    {
+        return convolutionTailWorker;
+    }
+
+    //==============================================================================
+    /** Runs job on the shared low-priority background thread. */
+    void runInBackground (std::function<void()> job)
+    {
+        backgroundPool.addJob (std::move (job));
+    }
+
+private:
+    //==============================================================================
+    DelayMemoryPool<float> delayMemoryPool;
+    DelayMemoryPool<double> doubleDelayMemoryPool;
+
+    juce::CriticalSection designLock;
+    std::map<Key, std::weak_ptr<const CutFilterDesign>> cutFilterDesigns;
+
+    juce::CriticalSection tableLock;
+    std::map<Key, LookupTablePtr> lookupTables;
+
+    // outlives the pool, whose jobs can still be dropping convolvers
+    ConvolutionTailWorker convolutionTailWorker;
+    juce::ThreadPool backgroundPool { 1 };
+
+    JUCE_DECLARE_NON_COPYABLE (SharedDspResources)
+};